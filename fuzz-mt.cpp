@@ -0,0 +1,301 @@
+/*
+ * Differential fuzzing of the Mersenne Twister against the reference.
+ *
+ * Each input is read as a program of operations -- seed, rand_u32, the
+ * inline rand_u32_fast, bulk fills of random lengths, borrowing, discard,
+ * save/restore and kernel switches -- that is run on both our generator and
+ * the reentrant reference, failing as soon as they disagree.
+ *
+ * Built normally, this has a main() that runs a number of random programs,
+ * or replays the files given on the command line.  Built with
+ * -DMT_LIBFUZZER -fsanitize=fuzzer (see "make fuzz-libfuzzer"), libFuzzer
+ * drives LLVMFuzzerTestOneInput() instead.
+ */
+
+#include <inttypes.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+namespace mt {
+  #include "mersenne-twister.h"
+}
+
+namespace reference {
+  #include "reference/mt19937ar-r.h"
+}
+
+// Reads the input as a stream of bytes, returning zeros once it runs out
+class Input {
+  const uint8_t* data_;
+  size_t size_;
+
+public:
+  Input(const uint8_t* data, size_t size) : data_(data), size_(size)
+  {
+  }
+
+  bool empty() const
+  {
+    return size_ == 0;
+  }
+
+  uint8_t u8()
+  {
+    if ( size_ == 0 )
+      return 0;
+
+    --size_;
+    return *data_++;
+  }
+
+  uint16_t u16()
+  {
+    const uint16_t lo = u8();
+    return lo | uint16_t(u8()) << 8;
+  }
+
+  uint32_t u32()
+  {
+    const uint32_t lo = u16();
+    return lo | uint32_t(u16()) << 16;
+  }
+};
+
+enum Op {
+  OP_SEED,
+  OP_RAND_U32,
+  OP_RAND_U32_FAST,
+  OP_U32_ARRAY,
+  OP_DOUBLE_ARRAY,
+  OP_BYTES,
+  OP_BORROW,
+  OP_DISCARD,
+  OP_SAVE,
+  OP_RESTORE,
+  OP_KERNEL,
+  OPS
+};
+
+static const char* op_names[OPS] = {
+  "seed", "rand_u32", "rand_u32_fast", "rand_u32_array",
+  "rand_double_array", "rand_bytes", "rand_u32_borrow", "discard", "save",
+  "restore", "kernel"
+};
+
+static void fail(Op op, size_t step, const char* what)
+{
+  fprintf(stderr, "fuzz-mt: %s differs at step %zu (%s, kernel %s)\n",
+      op_names[op], step, what, mt::kernel_current());
+  abort();
+}
+
+static void run(const uint8_t* data, size_t size)
+{
+  Input in(data, size);
+
+  reference::genrand_state theirs, saved_theirs;
+  mt::MTState saved_ours;
+
+  // Both start out seeded, since the reference seeds itself lazily
+  mt::kernel_select(mt::kernel_name(0));
+  mt::seed(5489);
+  reference::init_genrand_r(&theirs, 5489);
+  mt::get_state(&saved_ours);
+  saved_theirs = theirs;
+
+  std::vector<uint32_t> words;
+  std::vector<double> doubles;
+  std::vector<uint8_t> bytes;
+
+  for ( size_t step = 0; !in.empty(); ++step ) {
+    const Op op = Op(in.u8() % OPS);
+
+    switch ( op ) {
+      case OP_SEED: {
+        const uint32_t value = in.u32();
+        mt::seed(value);
+        reference::init_genrand_r(&theirs, value);
+        break;
+      }
+
+      case OP_RAND_U32:
+        if ( mt::rand_u32() != reference::genrand_int32_r(&theirs) )
+          fail(op, step, "number");
+        break;
+
+      case OP_RAND_U32_FAST: {
+        // A run of them, so that some cross a refill
+        const size_t count = in.u16() % 1300;
+        for ( size_t n = 0; n < count; ++n ) {
+          if ( mt::rand_u32_fast() != reference::genrand_int32_r(&theirs) )
+            fail(op, step, "number");
+        }
+        break;
+      }
+
+      case OP_U32_ARRAY: {
+        const size_t count = in.u16() % 2048;
+        words.resize(count + 1);
+        mt::rand_u32_array(&words[0], count);
+        for ( size_t n = 0; n < count; ++n ) {
+          if ( words[n] != reference::genrand_int32_r(&theirs) )
+            fail(op, step, "element");
+        }
+        break;
+      }
+
+      case OP_DOUBLE_ARRAY: {
+        const size_t count = in.u16() % 1024;
+        doubles.resize(count + 1);
+        mt::rand_double_array(&doubles[0], count);
+        for ( size_t n = 0; n < count; ++n ) {
+          if ( doubles[n] != reference::genrand_res53_r(&theirs) )
+            fail(op, step, "element");
+        }
+        break;
+      }
+
+      case OP_BYTES: {
+        // Odd lengths and offsets exercise the unaligned head and tail
+        const size_t len = in.u16() % 8192;
+        const size_t offset = in.u8() % 16;
+        const bool stream = in.u8() & 1;
+
+        // Streaming stores are normally only used for huge buffers
+        mt::rand_bytes_stream_threshold(stream? 1 : 0);
+
+        bytes.resize(offset + len + 4);
+        mt::rand_bytes(&bytes[offset], len);
+
+        for ( size_t n = 0; n < len; n += 4 ) {
+          const uint32_t expected = reference::genrand_int32_r(&theirs);
+          const size_t k = len - n < 4? len - n : 4;
+          if ( memcmp(&bytes[offset + n], &expected, k) != 0 )
+            fail(op, step, "byte");
+        }
+
+        mt::rand_bytes_stream_threshold(0);
+        break;
+      }
+
+      case OP_BORROW: {
+        size_t count = in.u16() % 1300;
+        const size_t asked = count;
+        const uint32_t* p = mt::rand_u32_borrow(&count);
+
+        if ( count > asked || (count == 0 && asked > 0) )
+          fail(op, step, "count");
+
+        for ( size_t n = 0; n < count; ++n ) {
+          if ( p[n] != reference::genrand_int32_r(&theirs) )
+            fail(op, step, "element");
+        }
+        break;
+      }
+
+      case OP_DISCARD: {
+        // Short skips, long ones, and ones that end exactly on a block
+        const uint32_t r = in.u32();
+        uint64_t count = r % 1300;
+
+        if ( (r >> 30) == 1 )
+          count = r % 200000;
+        else if ( (r >> 30) == 2 ) {
+          mt::MTState current;
+          mt::get_state(&current);
+          count = (624 - current.index) + 624*(r % 40);
+        }
+
+        mt::discard(count);
+        for ( uint64_t n = 0; n < count; ++n )
+          reference::genrand_int32_r(&theirs);
+        break;
+      }
+
+      case OP_SAVE:
+        mt::get_state(&saved_ours);
+        saved_theirs = theirs;
+        break;
+
+      case OP_RESTORE:
+        mt::set_state(&saved_ours);
+        theirs = saved_theirs;
+        break;
+
+      case OP_KERNEL:
+        mt::kernel_select(mt::kernel_name(in.u8() % mt::kernel_count()));
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  // Whatever happened, the streams must still be in step a block later
+  for ( size_t n = 0; n < 700; ++n ) {
+    if ( mt::rand_u32() != reference::genrand_int32_r(&theirs) )
+      fail(OP_RAND_U32, n, "after the program");
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  run(data, size);
+  return 0;
+}
+
+#ifndef MT_LIBFUZZER
+static bool run_file(const char* filename)
+{
+  FILE* f = fopen(filename, "rb");
+  if ( f == NULL ) {
+    perror(filename);
+    return false;
+  }
+
+  std::vector<uint8_t> data;
+  uint8_t buffer[4096];
+  size_t n;
+
+  while ( (n = fread(buffer, 1, sizeof(buffer), f)) > 0 )
+    data.insert(data.end(), buffer, buffer + n);
+
+  fclose(f);
+  run(data.empty()? NULL : &data[0], data.size());
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  // With file arguments, replay them like libFuzzer would
+  if ( argc > 1 && strncmp(argv[1], "--runs=", 7) != 0 ) {
+    for ( int n = 1; n < argc; ++n ) {
+      if ( !run_file(argv[n]) )
+        return 1;
+    }
+
+    printf("fuzz-mt: %d inputs OK\n", argc - 1);
+    return 0;
+  }
+
+  const unsigned long runs = argc > 1? strtoul(argv[1] + 7, NULL, 10) : 2000;
+
+  std::mt19937 engine(20171206);
+  std::vector<uint8_t> data;
+
+  for ( unsigned long r = 0; r < runs; ++r ) {
+    data.resize(engine() % 512);
+    for ( auto& byte : data )
+      byte = uint8_t(engine());
+
+    run(data.empty()? NULL : &data[0], data.size());
+  }
+
+  printf("fuzz-mt: %lu random programs OK (%zu kernels)\n", runs,
+      mt::kernel_count());
+  return 0;
+}
+#endif
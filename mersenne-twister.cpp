@@ -15,11 +15,32 @@
  * 2015-02-17, 2017-12-06
  */
 
+#include <algorithm>
+#include <atomic>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include "mersenne-twister.h"
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
+
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+
 // Better on older Intel Core i7, but worse on newer Intel Xeon CPUs (undefine
-// it on those).
+// it on those).  Rather than guessing, "make tune" can measure which of the
+// kernels below is fastest on this machine.
 //#define MT_UNROLL_MORE
 
 /*
@@ -32,91 +53,309 @@ static const size_t DIFF   = SIZE - PERIOD;
 
 static const uint32_t MAGIC = 0x9908b0df;
 
-// State for a singleton Mersenne Twister. If you want to make this into a
-// class, these are what you need to isolate.
-struct MTState {
-  uint32_t MT[SIZE];
-  uint32_t MT_TEMPERED[SIZE];
-  size_t index = SIZE;
-};
+// State for the singleton Mersenne Twister used by the functions without an
+// _r suffix.  The MTState struct itself is in the header, and the state is
+// exported so that the inline rand_u32_fast() there can reach it.  It starts
+// on a cache line, but MTState itself doesn't require that, see the header.
+#if defined(__GNUC__)
+__attribute__((aligned(64)))
+#endif
+MTState mt_global_state = {{0}, {0}, SIZE, {0}};
+static MTState& state = mt_global_state;
 
-static MTState state;
+static_assert(sizeof(state.MT) == SIZE*sizeof(uint32_t),
+    "MTState in the header must hold SIZE numbers");
+
+static_assert(offsetof(MTState, MT_TEMPERED) % 64 == 0 &&
+    sizeof(MTState) % 64 == 0,
+    "Both arrays should start on a cache line, and so should arena states");
+
+static_assert(sizeof(MTCompact) % 64 == 0,
+    "Compact states in an arena should start on a cache line");
+
+static_assert(sizeof(((MTCompact*)0)->MT) == SIZE*sizeof(uint32_t),
+    "MTCompact in the header must hold SIZE numbers");
 
 #define M32(x) (0x80000000 & x) // 32nd MSB
 #define L31(x) (0x7FFFFFFF & x) // 31 LSBs
 
 #define UNROLL(expr) \
-  y = M32(state.MT[i]) | L31(state.MT[i+1]); \
-  state.MT[i] = state.MT[expr] ^ (y >> 1) ^ (((int32_t(y) << 31) >> 31) & MAGIC); \
+  y = M32(MT[i]) | L31(MT[i+1]); \
+  MT[i] = MT[expr] ^ (y >> 1) ^ (((int32_t(y) << 31) >> 31) & MAGIC); \
   ++i;
 
-static void generate_numbers()
+/*
+ * The twist, with the first loop unrolled U1 times and the second U2 times.
+ *
+ * For performance reasons, we've unrolled the loop three times, thus
+ * mitigating the need for any modulus operations. Anyway, it seems this
+ * trick is old hat: http://www.quadibloc.com/crypto/co4814.htm
+ *
+ * Which unroll factors are fastest depends on the CPU, so there are several
+ * instantiations for the tuner to pick from below.
+ */
+template<size_t U1, size_t U2>
+static void twist(uint32_t* MT)
 {
-  /*
-   * For performance reasons, we've unrolled the loop three times, thus
-   * mitigating the need for any modulus operations. Anyway, it seems this
-   * trick is old hat: http://www.quadibloc.com/crypto/co4814.htm
-   */
-
   size_t i = 0;
   uint32_t y;
 
   // i = [0 ... 226]
-  while ( i < DIFF ) {
-    /*
-     * We're doing 226 = 113*2, an even number of steps, so we can safely
-     * unroll one more step here for speed:
-     */
-    UNROLL(i+PERIOD);
+  while ( i + U1 <= DIFF ) {
+    for ( size_t k = 0; k < U1; ++k ) {
+      UNROLL(i+PERIOD);
+    }
+  }
 
-#ifdef MT_UNROLL_MORE
+  // 227 is prime, so any unrolling leaves some steps over
+  for ( size_t k = 0; k < DIFF % U1; ++k ) {
     UNROLL(i+PERIOD);
-#endif
   }
 
   // i = [227 ... 622]
-  while ( i < SIZE -1 ) {
+  while ( i + U2 <= SIZE-1 ) {
     /*
      * 623-227 = 396 = 2*2*3*3*11, so we can unroll this loop in any number
-     * that evenly divides 396 (2, 4, 6, etc). Here we'll unroll 11 times.
+     * that evenly divides 396 (2, 4, 6, etc) without leftovers.
      */
-    UNROLL(i-DIFF);
+    for ( size_t k = 0; k < U2; ++k ) {
+      UNROLL(i-DIFF);
+    }
+  }
 
-#ifdef MT_UNROLL_MORE
-    UNROLL(i-DIFF);
-    UNROLL(i-DIFF);
-    UNROLL(i-DIFF);
-    UNROLL(i-DIFF);
+  for ( size_t k = 0; k < (SIZE-1-DIFF) % U2; ++k ) {
     UNROLL(i-DIFF);
-    UNROLL(i-DIFF);
-    UNROLL(i-DIFF);
-    UNROLL(i-DIFF);
-    UNROLL(i-DIFF);
-    UNROLL(i-DIFF);
-#endif
   }
 
   {
     // i = 623, last step rolls over
-    y = M32(state.MT[SIZE-1]) | L31(state.MT[0]);
-    state.MT[SIZE-1] = state.MT[PERIOD-1] ^ (y >> 1) ^ (((int32_t(y) << 31) >>
+    y = M32(MT[SIZE-1]) | L31(MT[0]);
+    MT[SIZE-1] = MT[PERIOD-1] ^ (y >> 1) ^ (((int32_t(y) << 31) >>
           31) & MAGIC);
   }
+}
+
+/*
+ * Explicitly vectorized twists, W words at a time.  Within the first loop the
+ * words read at i+PERIOD haven't been written yet, and within the second the
+ * ones at i-DIFF were written at least DIFF steps earlier, so W consecutive
+ * steps never depend on each other as long as W <= DIFF.
+ */
+#define TWIST_SIMD(W, VEC, LOAD, STORE, SET1, AND, OR, XOR, SRLI, SLLI, SRAI) \
+  const VEC upper = SET1(0x80000000); \
+  const VEC lower = SET1(0x7fffffff); \
+  const VEC magic = SET1(MAGIC); \
+  size_t i = 0; \
+  uint32_t y; \
+  \
+  for ( ; i + W <= DIFF; i += W ) { \
+    const VEC v = OR(AND(LOAD((const VEC*)&MT[i]), upper), \
+                     AND(LOAD((const VEC*)&MT[i+1]), lower)); \
+    const VEC m = AND(SRAI(SLLI(v, 31), 31), magic); \
+    STORE((VEC*)&MT[i], XOR(LOAD((const VEC*)&MT[i+PERIOD]), \
+          XOR(SRLI(v, 1), m))); \
+  } \
+  \
+  for ( size_t k = 0; k < DIFF % W; ++k ) { \
+    UNROLL(i+PERIOD); \
+  } \
+  \
+  for ( ; i + W <= SIZE-1; i += W ) { \
+    const VEC v = OR(AND(LOAD((const VEC*)&MT[i]), upper), \
+                     AND(LOAD((const VEC*)&MT[i+1]), lower)); \
+    const VEC m = AND(SRAI(SLLI(v, 31), 31), magic); \
+    STORE((VEC*)&MT[i], XOR(LOAD((const VEC*)&MT[i-DIFF]), \
+          XOR(SRLI(v, 1), m))); \
+  } \
+  \
+  for ( size_t k = 0; k < (SIZE-1-DIFF) % W; ++k ) { \
+    UNROLL(i-DIFF); \
+  } \
+  \
+  y = M32(MT[SIZE-1]) | L31(MT[0]); \
+  MT[SIZE-1] = MT[PERIOD-1] ^ (y >> 1) ^ (((int32_t(y) << 31) >> 31) & \
+      MAGIC);
+
+#ifdef __SSE2__
+static void twist_sse2(uint32_t* MT)
+{
+  TWIST_SIMD(4, __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_set1_epi32,
+      _mm_and_si128, _mm_or_si128, _mm_xor_si128, _mm_srli_epi32,
+      _mm_slli_epi32, _mm_srai_epi32)
+}
+#endif
+
+#ifdef __AVX2__
+static void twist_avx2(uint32_t* MT)
+{
+  TWIST_SIMD(8, __m256i, _mm256_loadu_si256, _mm256_storeu_si256,
+      _mm256_set1_epi32, _mm256_and_si256, _mm256_or_si256, _mm256_xor_si256,
+      _mm256_srli_epi32, _mm256_slli_epi32, _mm256_srai_epi32)
+}
+#endif
+
+struct Kernel {
+  const char* name;
+  void (*twist)(uint32_t* MT);
+};
+
+static const Kernel kernels[] = {
+  {"unroll-1", twist<1, 1>},
+  {"unroll-2x11", twist<2, 11>},  // what MT_UNROLL_MORE used to do
+  {"unroll-4", twist<4, 4>},
+  {"unroll-8x12", twist<8, 12>},
+#ifdef __SSE2__
+  {"sse2", twist_sse2},
+#endif
+#ifdef __AVX2__
+  {"avx2", twist_avx2},
+#endif
+};
+
+static const size_t KERNELS = sizeof(kernels) / sizeof(kernels[0]);
+
+static const Kernel* find_kernel(const char* name)
+{
+  for ( size_t n = 0; name != NULL && n < KERNELS; ++n )
+    if ( !strcmp(kernels[n].name, name) )
+      return &kernels[n];
+
+  return NULL;
+}
+
+/*
+ * The kernel to start out with is, in order of preference, the one named by
+ * the MT_KERNEL environment variable, the one named by the MT_KERNEL macro
+ * (set by "make tune"), unroll-2x11 if MT_UNROLL_MORE is defined, or else
+ * unroll-1.
+ */
+static const Kernel* initial_kernel()
+{
+  const Kernel* k = find_kernel(getenv("MT_KERNEL"));
+
+#ifdef MT_KERNEL
+  if ( k == NULL )
+    k = find_kernel(MT_KERNEL);
+#endif
+
+#ifdef MT_UNROLL_MORE
+  if ( k == NULL )
+    k = find_kernel("unroll-2x11");
+#endif
+
+  return k != NULL? k : &kernels[0];
+}
+
+/*
+ * The selected kernel is shared by all states, so it's atomic: other threads
+ * may be twisting their own states while it changes.  It starts out as
+ * unroll-1 through constant initialization, so that the generator works even
+ * from static constructors in other files, and the choice of initial_kernel()
+ * is applied on first use instead.
+ */
+static std::atomic<const Kernel*> selected_kernel(&kernels[0]);
+
+static const Kernel* current_kernel()
+{
+  static const bool initialized =
+    (selected_kernel.store(initial_kernel(), std::memory_order_relaxed), true);
+  (void) initialized;
+
+  return selected_kernel.load(std::memory_order_relaxed);
+}
+
+static inline uint32_t temper(uint32_t y)
+{
+  y ^= y >> 11;
+  y ^= y << 7  & 0x9d2c5680;
+  y ^= y << 15 & 0xefc60000;
+  y ^= y >> 18;
+  return y;
+}
+
+static void generate_numbers(MTState& s)
+{
+  current_kernel()->twist(s.MT);
 
   // Temper all numbers in a batch
-  for (size_t i = 0; i < SIZE; ++i) {
-    y = state.MT[i];
-    y ^= y >> 11;
-    y ^= y << 7  & 0x9d2c5680;
-    y ^= y << 15 & 0xefc60000;
-    y ^= y >> 18;
-    state.MT_TEMPERED[i] = y;
+  for (size_t i = 0; i < SIZE; ++i)
+    s.MT_TEMPERED[i] = temper(s.MT[i]);
+
+  s.index = 0;
+}
+
+extern "C" size_t kernel_count()
+{
+  return KERNELS;
+}
+
+extern "C" const char* kernel_name(size_t index)
+{
+  return index < KERNELS? kernels[index].name : NULL;
+}
+
+extern "C" const char* kernel_current()
+{
+  return current_kernel()->name;
+}
+
+extern "C" int kernel_select(const char* name)
+{
+  const Kernel* k = find_kernel(name);
+
+  if ( k == NULL )
+    return -1;
+
+  // Apply the initial choice first, so that it can't override this one later
+  current_kernel();
+  selected_kernel.store(k, std::memory_order_relaxed);
+  return 0;
+}
+
+static double monotonic_secs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+extern "C" const char* kernel_tune()
+{
+  /*
+   * Time a few thousand twists with each kernel on a scratch state that stays
+   * in L1, keep the best of several rounds so that a stray interrupt doesn't
+   * decide the winner, and select the fastest.
+   */
+  static const int ROUNDS = 7;
+  static const int TWISTS = 2000;
+
+  MTState scratch;
+  seed_r(&scratch, 5489);
+
+  const Kernel* best = current_kernel();
+  double best_secs = 1e300;
+
+  for ( size_t n = 0; n < KERNELS; ++n ) {
+    double secs = 1e300;
+
+    for ( int round = 0; round < ROUNDS; ++round ) {
+      const double start = monotonic_secs();
+      for ( int t = 0; t < TWISTS; ++t )
+        kernels[n].twist(scratch.MT);
+      secs = std::min(secs, monotonic_secs() - start);
+    }
+
+    if ( secs < best_secs ) {
+      best_secs = secs;
+      best = &kernels[n];
+    }
   }
 
-  state.index = 0;
+  selected_kernel.store(best, std::memory_order_relaxed);
+  return best->name;
 }
 
-extern "C" void seed(uint32_t value)
+static void seed_words(uint32_t* MT, uint32_t value)
 {
   /*
    * The equation below is a linear congruential generator (LCG), one of the
@@ -149,19 +388,1254 @@ extern "C" void seed(uint32_t value)
    * masking with 0xFFFFFFFF below.
    */
 
-  state.MT[0] = value;
-  state.index = SIZE;
+  MT[0] = value;
 
   for ( uint_fast32_t i=1; i<SIZE; ++i )
-    state.MT[i] = 0x6c078965*(state.MT[i-1] ^ state.MT[i-1]>>30) + i;
+    MT[i] = 0x6c078965*(MT[i-1] ^ MT[i-1]>>30) + i;
 }
 
-extern "C" uint32_t rand_u32()
+extern "C" void seed_r(MTState* s, uint32_t value)
+{
+  seed_words(s->MT, value);
+  s->index = SIZE;
+}
+
+extern "C" void seed(uint32_t value)
+{
+  seed_r(&state, value);
+}
+
+extern "C" void seed_batch_r(MTState* states, const uint32_t* values,
+    size_t count)
+{
+  /*
+   * Each state's LCG is a serial chain of 623 multiplies, so seeding one state
+   * at a time leaves the CPU waiting on the latency of every multiply.  Here
+   * we run LANES chains side by side; the x[] update is a plain vector
+   * multiply-add and only the stores go to the separate states.
+   */
+  static const size_t LANES = 8;
+
+  for ( ; count >= LANES; count -= LANES, states += LANES, values += LANES ) {
+    uint32_t x[LANES];
+
+    for ( size_t k = 0; k < LANES; ++k ) {
+      x[k] = values[k];
+      states[k].MT[0] = x[k];
+      states[k].index = SIZE;
+    }
+
+    for ( uint_fast32_t i=1; i<SIZE; ++i ) {
+      for ( size_t k = 0; k < LANES; ++k ) {
+        x[k] = 0x6c078965*(x[k] ^ x[k]>>30) + i;
+        states[k].MT[i] = x[k];
+      }
+    }
+  }
+
+  for ( size_t k = 0; k < count; ++k )
+    seed_r(&states[k], values[k]);
+}
+
+extern "C" void get_state(MTState* out)
+{
+  *out = state;
+}
+
+extern "C" void set_state(const MTState* in)
+{
+  state = *in;
+}
+
+static const size_t HUGE_PAGE = 2*1024*1024;
+
+// Round up to whole huge pages
+static size_t arena_bytes(size_t bytes)
+{
+  return (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+}
+
+static void* arena_alloc(size_t bytes, int* huge_pages)
+{
+  int huge = 0;
+
+  if ( bytes == 0 )
+    return NULL;
+
+  bytes = arena_bytes(bytes);
+  void* p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+  if ( p != MAP_FAILED )
+    huge = 2;
+#endif
+
+  if ( p == MAP_FAILED ) {
+    /*
+     * No reserved huge pages.  Map an extra huge page's worth, trim it so the
+     * arena starts on a 2 MiB boundary, and ask for transparent huge pages.
+     */
+    uint8_t* raw = static_cast<uint8_t*>(mmap(NULL, bytes + HUGE_PAGE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+    if ( raw == MAP_FAILED )
+      return NULL;
+
+    const size_t head = (HUGE_PAGE - reinterpret_cast<uintptr_t>(raw) %
+        HUGE_PAGE) % HUGE_PAGE;
+
+    if ( head > 0 )
+      munmap(raw, head);
+    munmap(raw + head + bytes, HUGE_PAGE - head);
+
+    p = raw + head;
+
+#ifdef MADV_HUGEPAGE
+    if ( madvise(p, bytes, MADV_HUGEPAGE) == 0 )
+      huge = 1;
+#endif
+  }
+
+  if ( huge_pages != NULL )
+    *huge_pages = huge;
+
+  return p;
+}
+
+static void arena_free(void* p, size_t bytes)
+{
+  if ( p != NULL )
+    munmap(p, arena_bytes(bytes));
+}
+
+extern "C" MTState* state_arena_alloc(size_t count, int* huge_pages)
+{
+  return static_cast<MTState*>(arena_alloc(count*sizeof(MTState),
+        huge_pages));
+}
+
+extern "C" void state_arena_free(MTState* states, size_t count)
+{
+  arena_free(states, count*sizeof(MTState));
+}
+
+/*
+ * NUMA placement, with the raw system calls so that we don't need libnuma.
+ * The constants are the ones from <numaif.h>.
+ */
+static const int MT_MPOL_BIND = 2;
+static const unsigned MT_MPOL_MF_MOVE = 1 << 1;
+static const int MT_MPOL_F_NODE = 1 << 0;
+static const int MT_MPOL_F_ADDR = 1 << 1;
+static const unsigned long MAX_NODES = 1024;
+
+extern "C" int current_node()
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu = 0, node = 0;
+  if ( syscall(SYS_getcpu, &cpu, &node, NULL) == 0 )
+    return int(node);
+#endif
+  return 0;
+}
+
+extern "C" MTState* state_node_alloc(size_t count, int node)
+{
+  const size_t bytes = count*sizeof(MTState);
+
+  if ( bytes == 0 )
+    return NULL;
+
+  // First touch puts pages on the local node anyway, so only binding to an
+  // explicit node has to succeed
+  const bool required = node >= 0;
+
+  if ( node < 0 )
+    node = current_node();
+
+  if ( required && size_t(node) >= MAX_NODES )
+    return NULL;
+
+  void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( p == MAP_FAILED )
+    return NULL;
+
+  bool bound = false;
+
+#if defined(__linux__) && defined(SYS_mbind)
+  // Bind before anything touches the pages, so that they start out there
+  if ( node >= 0 && size_t(node) < MAX_NODES ) {
+    unsigned long mask[MAX_NODES / (8*sizeof(unsigned long))] = {0};
+    mask[node / (8*sizeof(unsigned long))] |=
+      1ul << (node % (8*sizeof(unsigned long)));
+    bound = syscall(SYS_mbind, p, bytes, MT_MPOL_BIND, mask, MAX_NODES + 1,
+        MT_MPOL_MF_MOVE) == 0;
+  }
+#endif
+
+  // A node that doesn't exist or is offline would give unbound memory
+  if ( required && !bound ) {
+    munmap(p, bytes);
+    return NULL;
+  }
+
+  return static_cast<MTState*>(p);
+}
+
+extern "C" void state_node_free(MTState* states, size_t count)
+{
+  if ( states != NULL )
+    munmap(states, count*sizeof(MTState));
+}
+
+extern "C" int state_node(const MTState* s)
+{
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+  int node = -1;
+  if ( syscall(SYS_get_mempolicy, &node, NULL, 0, s,
+        MT_MPOL_F_NODE | MT_MPOL_F_ADDR) == 0 )
+    return node;
+#else
+  (void)s;
+#endif
+  return -1;
+}
+
+// Frees the calling thread's state when the thread exits
+struct ThreadState {
+  MTState* state;
+
+  ThreadState() : state(NULL)
+  {
+  }
+
+  ~ThreadState()
+  {
+    state_node_free(state, 1);
+  }
+};
+
+static thread_local ThreadState thread_local_state;
+
+extern "C" MTState* thread_state(uint32_t value)
+{
+  MTState*& s = thread_local_state.state;
+
+  if ( s == NULL ) {
+    s = state_node_alloc(1, -1);
+    if ( s == NULL )
+      return NULL;
+    seed_r(s, value);
+  }
+
+  return s;
+}
+
+/*
+ * Compact states hold the twisted but untempered words only.  The tempering
+ * happens CHUNK words at a time into the scratch area of whoever is drawing
+ * from the state, so a state that isn't active costs nothing but its 2.5 KB.
+ */
+extern "C" void compact_seed(MTCompact* c, uint32_t value)
+{
+  seed_words(c->MT, value);
+  c->index = SIZE;
+}
+
+extern "C" MTCompact* compact_arena_alloc(size_t count, int* huge_pages)
+{
+  return static_cast<MTCompact*>(arena_alloc(count*sizeof(MTCompact),
+        huge_pages));
+}
+
+extern "C" void compact_arena_free(MTCompact* states, size_t count)
+{
+  arena_free(states, count*sizeof(MTCompact));
+}
+
+extern "C" void compact_select(MTScratch* scratch, MTCompact* c)
+{
+  /*
+   * Give back what wasn't drawn, it'll be tempered again next time.  A state
+   * reseeded while active is at SIZE already, which it must not go past.
+   */
+  if ( scratch->active != NULL ) {
+    MTCompact* a = scratch->active;
+    a->index = std::min(a->index + scratch->pos, uint32_t(SIZE));
+  }
+
+  scratch->active = c;
+  scratch->pos = scratch->end = 0;
+}
+
+extern "C" uint32_t compact_refill(MTScratch* scratch)
+{
+  static const size_t CHUNK = sizeof(scratch->words) / sizeof(uint32_t);
+  static_assert(SIZE % CHUNK == 0 && CHUNK*sizeof(uint32_t) == 64,
+      "The scratch area should hold one cache line of the block");
+
+  MTCompact* c = scratch->active;
+
+  // Past the numbers drawn; while active, index is where words[0] came from
+  c->index += scratch->end;
+
+  // Past SIZE only if reseeded while active, so there's a fresh block due
+  if ( c->index >= SIZE ) {
+    current_kernel()->twist(c->MT);
+    c->index = 0;
+  }
+
+  /*
+   * Always temper the whole cache line that holds the next number.  A fixed
+   * count vectorizes without a remainder loop, and only one line is touched.
+   */
+  const size_t base = c->index / CHUNK * CHUNK;
+  const uint32_t* line = &c->MT[base];
+
+  for ( size_t k = 0; k < CHUNK; ++k )
+    scratch->words[k] = temper(line[k]);
+
+  scratch->pos = c->index - base;
+  scratch->end = CHUNK;
+  c->index = base;
+
+  return scratch->words[scratch->pos++];
+}
+
+/*
+ * Incremental states twist the block INCREMENT words at a time.  Twisting
+ * the words in order, a chunk at a time, gives exactly what the whole twist
+ * does: word i reads word i+1, which is still untwisted, and either word
+ * i+PERIOD, also untwisted, or word i-DIFF, which has been twisted already.
+ * The last word wraps around to words 0 and PERIOD-1, both twisted by then.
+ */
+static const size_t INCREMENT = 16;
+
+static void twist_increment(uint32_t* MT, size_t begin)
 {
-  if ( state.index == SIZE ) {
-    generate_numbers();
-    state.index = 0;
+  const size_t end = begin + INCREMENT;
+  size_t i = begin;
+  uint32_t y;
+
+  // All but two chunks lie on one side of DIFF, with a fixed trip count
+  if ( end <= DIFF ) {
+    for ( size_t k = 0; k < INCREMENT; ++k ) {
+      UNROLL(i+PERIOD);
+    }
+    return;
+  }
+
+  if ( begin >= DIFF && end < SIZE ) {
+    for ( size_t k = 0; k < INCREMENT; ++k ) {
+      UNROLL(i-DIFF);
+    }
+    return;
   }
 
-  return state.MT_TEMPERED[state.index++];
+  // The chunk that straddles DIFF, and the last one, which wraps around
+  while ( i < DIFF ) {
+    UNROLL(i+PERIOD);
+  }
+
+  while ( i < std::min(end, SIZE-1) ) {
+    UNROLL(i-DIFF);
+  }
+
+  if ( end == SIZE ) {
+    y = M32(MT[SIZE-1]) | L31(MT[0]);
+    MT[SIZE-1] = MT[PERIOD-1] ^ (y >> 1) ^ (((int32_t(y) << 31) >>
+          31) & MAGIC);
+  }
+}
+
+extern "C" void incremental_seed(MTIncremental* s, uint32_t value)
+{
+  static_assert(SIZE % INCREMENT == 0 &&
+      sizeof(s->words) == INCREMENT*sizeof(uint32_t),
+      "The block must split evenly into increments");
+
+  seed_words(s->MT, value);
+  s->pos = INCREMENT;
+  s->next = 0;
+}
+
+extern "C" uint32_t incremental_refill(MTIncremental* s)
+{
+  const uint32_t* words = &s->MT[s->next];
+  twist_increment(s->MT, s->next);
+
+  for ( size_t k = 0; k < INCREMENT; ++k )
+    s->words[k] = temper(words[k]);
+
+  s->next = s->next + INCREMENT < SIZE? s->next + INCREMENT : 0;
+  s->pos = 1;
+  return s->words[0];
+}
+
+/*
+ * Lookahead states keep the untempered state at the front of a window of
+ * blocks+1 blocks.  Element j of the stream only depends on elements j-SIZE,
+ * j-SIZE+1 and j-DIFF, so the next `blocks` blocks can be generated past the
+ * end of the current one in a single loop, with no wrap-around step and no
+ * split at DIFF.  The last block is then moved back to the front.
+ */
+extern "C" int lookahead_init(MTLookahead* s, size_t blocks, uint32_t value)
+{
+  void* p = NULL;
+
+  if ( blocks == 0 ||
+       posix_memalign(&p, 64, (2*blocks + 1)*SIZE*sizeof(uint32_t)) != 0 )
+    return -1;
+
+  s->window = static_cast<uint32_t*>(p);
+  s->tempered = s->window + (blocks + 1)*SIZE;
+  s->blocks = blocks;
+  lookahead_seed(s, value);
+  return 0;
+}
+
+extern "C" void lookahead_free(MTLookahead* s)
+{
+  free(s->window);
+  s->window = s->tempered = NULL;
+  s->next = s->end = NULL;
+}
+
+extern "C" void lookahead_seed(MTLookahead* s, uint32_t value)
+{
+  seed_words(s->window, value);
+  s->next = s->end = s->tempered + s->blocks*SIZE;
+}
+
+static void generate_lookahead(MTLookahead* s)
+{
+  uint32_t* x = s->window;
+  const size_t words = s->blocks*SIZE;
+
+  // The reads at j-DIFF are at least DIFF words behind, so this vectorizes
+  for ( size_t j = SIZE; j < SIZE + words; ++j ) {
+    const uint32_t y = M32(x[j-SIZE]) | L31(x[j-SIZE+1]);
+    x[j] = x[j-DIFF] ^ (y >> 1) ^ (((int32_t(y) << 31) >> 31) & MAGIC);
+  }
+
+  for ( size_t j = 0; j < words; ++j )
+    s->tempered[j] = temper(x[SIZE + j]);
+
+  memcpy(x, x + words, SIZE*sizeof(uint32_t));
+  s->next = s->tempered;
+}
+
+extern "C" uint32_t lookahead_refill(MTLookahead* s)
+{
+  generate_lookahead(s);
+  return *s->next++;
+}
+
+extern "C" void lookahead_u32_array(MTLookahead* s, uint32_t* out,
+    size_t count)
+{
+  while ( count > 0 ) {
+    if ( s->next == s->end )
+      generate_lookahead(s);
+
+    const size_t n = std::min(count, size_t(s->end - s->next));
+    memcpy(out, s->next, n*sizeof(uint32_t));
+    s->next += n;
+    out += n;
+    count -= n;
+  }
+}
+
+static inline uint32_t next_u32(MTState& s)
+{
+  if ( s.index == SIZE ) {
+    generate_numbers(s);
+    s.index = 0;
+  }
+
+  return s.MT_TEMPERED[s.index++];
+}
+
+extern "C" uint32_t rand_u32_r(MTState* s)
+{
+  return next_u32(*s);
+}
+
+extern "C" uint32_t rand_u32()
+{
+  return next_u32(state);
+}
+
+static void skip_numbers(MTState& s, uint64_t count)
+{
+  const size_t available = SIZE - s.index;
+
+  if ( count <= available ) {
+    s.index += count;
+    return;
+  }
+
+  count -= available;
+
+  // Whole blocks that are skipped only need the twist, not the tempering
+  for ( ; count > SIZE; count -= SIZE )
+    current_kernel()->twist(s.MT);
+
+  generate_numbers(s);
+  s.index = count;
+}
+
+extern "C" void discard_r(MTState* s, uint64_t count)
+{
+  skip_numbers(*s, count);
+}
+
+extern "C" void discard(uint64_t count)
+{
+  skip_numbers(state, count);
+}
+
+/*
+ * The slow path of the inline rand_u32_fast_r() in the header, kept out of
+ * line and cold so that the fast path stays a compare and a load.
+ */
+extern "C" __attribute__((cold, noinline)) uint32_t rand_u32_refill_r(
+    MTState* s)
+{
+  generate_numbers(*s);
+  return s->MT_TEMPERED[s->index++];
+}
+
+/*
+ * Take up to `count` consecutive tempered numbers straight from the current
+ * block, refilling it first if it is used up.  Returns a pointer into the
+ * block and sets `count` to how many were actually taken.
+ */
+static inline const uint32_t* take_block(MTState& s, size_t& count)
+{
+  if ( s.index == SIZE )
+    generate_numbers(s);
+
+  const size_t available = SIZE - s.index;
+  if ( count > available )
+    count = available;
+
+  const uint32_t* p = &s.MT_TEMPERED[s.index];
+  s.index += count;
+  return p;
+}
+
+static void u32_array(MTState& s, uint32_t* out, size_t count)
+{
+  while ( count > 0 ) {
+    size_t n = count;
+    const uint32_t* p = take_block(s, n);
+    memcpy(out, p, n * sizeof(uint32_t));
+    out += n;
+    count -= n;
+  }
+}
+
+extern "C" void rand_u32_array_r(MTState* s, uint32_t* out, size_t count)
+{
+  u32_array(*s, out, count);
+}
+
+extern "C" void rand_u32_array(uint32_t* out, size_t count)
+{
+  u32_array(state, out, count);
+}
+
+extern "C" const uint32_t* rand_u32_borrow_r(MTState* s, size_t* count)
+{
+  return take_block(*s, *count);
+}
+
+extern "C" const uint32_t* rand_u32_borrow(size_t* count)
+{
+  return take_block(state, *count);
+}
+
+// Same as genrand_res53() in the reference: [0, 1) with 53 bits of resolution
+static inline double res53(uint32_t a, uint32_t b)
+{
+  return ((a >> 5)*67108864.0 + (b >> 6)) * (1.0/9007199254740992.0);
+}
+
+static void double_array(MTState& s, double* out, size_t count)
+{
+  while ( count > 0 ) {
+    if ( s.index == SIZE )
+      generate_numbers(s);
+
+    const size_t pairs = (SIZE - s.index) / 2;
+
+    if ( pairs > 0 ) {
+      // Convert straight from the tempered block
+      const size_t n = count < pairs? count : pairs;
+      const uint32_t* p = &s.MT_TEMPERED[s.index];
+
+      for ( size_t k = 0; k < n; ++k )
+        out[k] = res53(p[2*k], p[2*k + 1]);
+
+      s.index += 2*n;
+      out += n;
+      count -= n;
+    } else {
+      // The pair straddles the end of the block
+      const uint32_t a = next_u32(s);
+      *out++ = res53(a, next_u32(s));
+      --count;
+    }
+  }
+}
+
+extern "C" void rand_double_array_r(MTState* s, double* out, size_t count)
+{
+  double_array(*s, out, count);
+}
+
+extern "C" void rand_double_array(double* out, size_t count)
+{
+  double_array(state, out, count);
+}
+
+/*
+ * Unbiased integer in [0, range) using Lemire's multiply-and-reject method,
+ * which only needs a division in the rare case that a draw lands in the
+ * biased low end of the product.
+ *
+ * https://arxiv.org/abs/1805.10941
+ */
+static inline uint32_t next_below(MTState& s, uint32_t range)
+{
+  uint64_t m = uint64_t(next_u32(s)) * range;
+  uint32_t low = uint32_t(m);
+
+  if ( low < range ) {
+    const uint32_t threshold = -range % range;
+
+    while ( low < threshold ) {
+      m = uint64_t(next_u32(s)) * range;
+      low = uint32_t(m);
+    }
+  }
+
+  return m >> 32;
+}
+
+// Same as next_below for ranges wider than 32 bits, using two numbers
+// Two numbers make one 64-bit number, the first one in the high half
+static inline uint64_t next_u64(MTState& s)
+{
+  const uint64_t hi = next_u32(s);
+  const uint64_t lo = next_u32(s);
+  return hi << 32 | lo;
+}
+
+static inline uint64_t next_below64(MTState& s, uint64_t range)
+{
+  uint64_t x = next_u64(s);
+  __uint128_t m = __uint128_t(x) * range;
+  uint64_t low = uint64_t(m);
+
+  if ( low < range ) {
+    const uint64_t threshold = -range % range;
+
+    while ( low < threshold ) {
+      x = next_u64(s);
+      m = __uint128_t(x) * range;
+      low = uint64_t(m);
+    }
+  }
+
+  return m >> 64;
+}
+
+extern "C" uint32_t rand_below_r(MTState* s, uint32_t range)
+{
+  return next_below(*s, range);
+}
+
+extern "C" uint32_t rand_below(uint32_t range)
+{
+  return next_below(state, range);
+}
+
+static void shuffle_u32(MTState& s, uint32_t* array, size_t count)
+{
+  /*
+   * Fisher-Yates, back to front.  Swap targets are drawn BATCH at a time and
+   * prefetched before any swapping, so that the cache misses on large arrays
+   * overlap instead of stalling one after another.  The draws happen in the
+   * same order as a plain one-at-a-time shuffle would make them.
+   */
+  static const size_t BATCH = 32;
+  uint32_t target[BATCH];
+  size_t n = count;
+
+  for ( ; n > UINT32_MAX; --n ) {
+    const uint64_t j = next_below64(s, n);
+    const uint32_t tmp = array[n-1];
+    array[n-1] = array[j];
+    array[j] = tmp;
+  }
+
+  while ( n > 1 ) {
+    const size_t batch = n-1 < BATCH? n-1 : BATCH;
+
+    for ( size_t k = 0; k < batch; ++k ) {
+      target[k] = next_below(s, uint32_t(n-k));
+      __builtin_prefetch(&array[target[k]], 1);
+    }
+
+    for ( size_t k = 0; k < batch; ++k ) {
+      const uint32_t tmp = array[n-1-k];
+      array[n-1-k] = array[target[k]];
+      array[target[k]] = tmp;
+    }
+
+    n -= batch;
+  }
+}
+
+extern "C" void rand_shuffle_u32_r(MTState* s, uint32_t* array, size_t count)
+{
+  shuffle_u32(*s, array, count);
+}
+
+extern "C" void rand_shuffle_u32(uint32_t* array, size_t count)
+{
+  shuffle_u32(state, array, count);
+}
+
+// Uniform double in the open interval (0, 1), with 53 bits of resolution
+static inline double next_double_open(MTState& s)
+{
+  const uint32_t a = next_u32(s) >> 5;
+  const uint32_t b = next_u32(s) >> 6;
+  return (a*67108864.0 + b + 0.5) * (1.0/9007199254740992.0);
+}
+
+/*
+ * Number of items to skip before the next one enters the reservoir, from
+ * Li's Algorithm L.  The skips are geometric with parameter w, which itself
+ * shrinks as the stream goes on, so the expected number of random numbers
+ * drawn is O(k (1 + log(n/k))) instead of O(n).
+ */
+static inline uint64_t reservoir_skip(MTState& s, double w)
+{
+  const double skip = floor(log(next_double_open(s)) / log1p(-w));
+  return skip < 18446744073709551615.0? uint64_t(skip) : UINT64_MAX;
+}
+
+static void init_reservoir(MTState& s, Reservoir* r, uint32_t k)
+{
+  r->k = k;
+
+  // Like rand_sample(), an empty sample draws nothing
+  if ( k == 0 ) {
+    r->w = 0;
+    r->next = UINT64_MAX;
+    return;
+  }
+
+  r->w = exp(log(next_double_open(s)) / k);
+  r->next = k + reservoir_skip(s, r->w);
+}
+
+static uint32_t next_reservoir_slot(MTState& s, Reservoir* r)
+{
+  if ( r->k == 0 )
+    return 0;
+
+  const uint32_t slot = next_below(s, r->k);
+  r->w *= exp(log(next_double_open(s)) / r->k);
+  const uint64_t skip = reservoir_skip(s, r->w);
+  r->next = skip < UINT64_MAX - r->next? r->next + 1 + skip : UINT64_MAX;
+  return slot;
+}
+
+extern "C" void reservoir_init_r(MTState* s, Reservoir* r, uint32_t k)
+{
+  init_reservoir(*s, r, k);
+}
+
+extern "C" void reservoir_init(Reservoir* r, uint32_t k)
+{
+  init_reservoir(state, r, k);
+}
+
+extern "C" uint32_t reservoir_slot_r(MTState* s, Reservoir* r)
+{
+  return next_reservoir_slot(*s, r);
+}
+
+extern "C" uint32_t reservoir_slot(Reservoir* r)
+{
+  return next_reservoir_slot(state, r);
+}
+
+/*
+ * Vitter's Method A: sequential sampling by inversion, one uniform number per
+ * selected item.  Used by Method D once the population is small.
+ */
+static void sample_method_a(MTState& s, uint64_t* out, size_t k, uint64_t n,
+    uint64_t cur)
+{
+  double top = double(n - k);
+  double remaining = double(n);
+
+  while ( k >= 2 ) {
+    const double v = next_double_open(s);
+    double quot = top / remaining;
+    uint64_t skip = 0;
+
+    while ( quot > v ) {
+      ++skip;
+      top -= 1;
+      remaining -= 1;
+      quot = quot * top / remaining;
+    }
+
+    cur += skip;
+    *out++ = cur++;
+    remaining -= 1;
+    --k;
+  }
+
+  const double skip = floor(remaining * next_double_open(s));
+  *out = cur + (skip < remaining? uint64_t(skip) : uint64_t(remaining) - 1);
+}
+
+/*
+ * Vitter's Method D, from "An Efficient Algorithm for Sequential Random
+ * Sampling", ACM Transactions on Mathematical Software 13(1), 1987.
+ *
+ * Each selected item costs a small constant number of uniform draws on
+ * average, by generating the skip length directly with rejection sampling.
+ * Falls back to Method A when n < 13k, where that is faster.
+ */
+static void sample_method_d(MTState& s, uint64_t* out, size_t k, uint64_t n)
+{
+  static const double ALPHA_INV = 13;
+
+  if ( k == 0 || k > n )
+    return;
+
+  uint64_t cur = 0;
+  double ninv = 1.0 / k;
+  double vprime = exp(log(next_double_open(s)) * ninv);
+  double qu1 = double(n - k + 1);
+  double threshold = ALPHA_INV * k;
+
+  while ( k > 1 && threshold < n ) {
+    const double nmin1inv = 1.0 / (k - 1);
+    double x, skip;
+
+    for (;;) {
+      // Step D2: generate skip and test it against the bound qu1
+      for (;;) {
+        x = n * (1.0 - vprime);
+        skip = floor(x);
+        if ( skip < qu1 )
+          break;
+        vprime = exp(log(next_double_open(s)) * ninv);
+      }
+
+      // Step D3: squeeze test
+      const double y1 = exp(log(next_double_open(s) * n / qu1) * nmin1inv);
+      vprime = y1 * (1.0 - x / n) * (qu1 / (qu1 - skip));
+      if ( vprime <= 1.0 )
+        break;
+
+      // Step D4: exact acceptance test
+      double y2 = 1.0;
+      double top = n - 1.0;
+      double bottom, limit;
+
+      if ( k - 1 > skip ) {
+        bottom = double(n - k);
+        limit = n - skip;
+      } else {
+        bottom = n - 1.0 - skip;
+        limit = qu1;
+      }
+
+      for ( double t = n - 1.0; t >= limit; t -= 1 ) {
+        y2 = y2 * top / bottom;
+        top -= 1;
+        bottom -= 1;
+      }
+
+      if ( n / (n - x) >= y1 * exp(log(y2) * nmin1inv) ) {
+        vprime = exp(log(next_double_open(s)) * nmin1inv);
+        break;
+      }
+
+      vprime = exp(log(next_double_open(s)) * ninv);
+    }
+
+    cur += uint64_t(skip);
+    *out++ = cur++;
+
+    n -= uint64_t(skip) + 1;
+    --k;
+    ninv = nmin1inv;
+    qu1 -= skip;
+    threshold -= ALPHA_INV;
+  }
+
+  if ( k > 1 )
+    sample_method_a(s, out, k, n, cur);
+  else
+    *out = cur + std::min(uint64_t(n * vprime), n - 1);
+}
+
+extern "C" void rand_sample_r(MTState* s, uint64_t* out, size_t k, uint64_t n)
+{
+  sample_method_d(*s, out, k, n);
+}
+
+extern "C" void rand_sample(uint64_t* out, size_t k, uint64_t n)
+{
+  sample_method_d(state, out, k, n);
+}
+
+/*
+ * Box-Muller transform over a group of 16 tempered words, producing 16
+ * normals.  Words [0, 8) give the radii and words [8, 16) the angles, so that
+ * both inputs and outputs are contiguous and the loop below vectorizes
+ * cleanly (8 floats per iteration with AVX).
+ *
+ * The log and sincos are single-precision Cephes-style polynomials with the
+ * argument reduction done on the 24-bit integer inputs, so there are no
+ * branches.  The absolute error against a double-precision libm transform of
+ * the same words stays below 2e-6 for every possible input.
+ *
+ * Note that sqrtf only vectorizes with -fno-math-errno (see the Makefile).
+ */
+static void box_muller(const uint32_t* in, float* out, size_t groups)
+{
+  static const float TWO_PI_24 = 6.28318530717958647692f / 16777216.0f;
+
+  for ( size_t g = 0; g < groups; ++g, in += 16, out += 16 ) {
+    for ( size_t k = 0; k < 8; ++k ) {
+      /*
+       * u = (1 ... 2^24) / 2^24, so that log(u) is finite, except that words
+       * below 2^24 give u = (1 ... 2^24) / 2^32.  Both are exact in a float,
+       * and together they give the radius all 32 bits where it's largest, so
+       * the normals reach |z| = 6.66 instead of stopping at 5.77.  The scale
+       * is 2^-24 or 2^-32, made from its exponent bits so that this stays
+       * branch-free and vectorizes.
+       */
+      const uint32_t w = in[k];
+      const int32_t small = w < (1u << 24);
+      union { int32_t i; float f; } scale = { (103 - 8*small) << 23 };
+      const float u = float(int32_t((w >> (8 - 8*small)) + 1)) * scale.f;
+
+      // Split u into mantissa m in [0.5, 1) and exponent e, then fold m into
+      // [sqrt(1/2), sqrt(2)) for the polynomial.
+      union { float f; int32_t i; } bits = { u };
+      int32_t e = ((bits.i >> 23) & 0xff) - 126;
+      bits.i = (bits.i & 0x007fffff) | 0x3f000000;
+      const int32_t lo = bits.f < 0.707106781186547524f;
+      e -= lo;
+      float x = bits.f + (lo? bits.f : 0.0f) - 1.0f;
+
+      const float z = x*x;
+      float y = 7.0376836292e-2f;
+      y = y*x - 1.1514610310e-1f;
+      y = y*x + 1.1676998740e-1f;
+      y = y*x - 1.2420140846e-1f;
+      y = y*x + 1.4249322787e-1f;
+      y = y*x - 1.6668057665e-1f;
+      y = y*x + 2.0000714765e-1f;
+      y = y*x - 2.4999993993e-1f;
+      y = y*x + 3.3333331174e-1f;
+      y = y*x*z;
+      y += -2.12194440e-4f * float(e);
+      y += -0.5f * z;
+      const float log_u = x + y + 0.693359375f * float(e);
+
+      const float r = sqrtf(-2.0f * log_u);
+
+      // Angle 2*pi*v/2^24, reduced to the nearest quadrant q and a remainder
+      // a in [-pi/4, pi/4).
+      const int32_t v = int32_t(in[k+8] >> 8) + (1 << 21);
+      const int32_t q = (v >> 22) & 3;
+      const float a = float((v & ((1 << 22) - 1)) - (1 << 21)) * TWO_PI_24;
+      const float a2 = a*a;
+
+      const float sin_a = a + a*a2*(-1.6666654611e-1f + a2*(8.3321608736e-3f +
+            a2*-1.9515295891e-4f));
+      const float cos_a = 1.0f - 0.5f*a2 + a2*a2*(4.166664568298827e-2f +
+          a2*(-1.388731625493765e-3f + a2*2.443315711809948e-5f));
+
+      const int32_t swap = q & 1;
+      const float sin_sign = float(1 - (q & 2));
+      const float cos_sign = float(1 - ((q + 1) & 2));
+
+      out[k]   = r * cos_sign * (swap? sin_a : cos_a);
+      out[k+8] = r * sin_sign * (swap? cos_a : sin_a);
+    }
+  }
+}
+
+static void normal_array(MTState& s, float* out, size_t count)
+{
+  while ( count > 0 ) {
+    if ( s.index == SIZE )
+      generate_numbers(s);
+
+    const size_t groups = (SIZE - s.index) / 16;
+
+    if ( groups > 0 && count >= 16 ) {
+      // Transform straight from the tempered block
+      const size_t n = count/16 < groups? count/16 : groups;
+      box_muller(&s.MT_TEMPERED[s.index], out, n);
+      s.index += 16*n;
+      out += 16*n;
+      count -= 16*n;
+    } else {
+      // Group straddles the end of the block, or fewer than 16 are wanted
+      uint32_t words[16];
+      float normals[16];
+
+      for ( size_t k = 0; k < 16; ++k )
+        words[k] = next_u32(s);
+
+      box_muller(words, normals, 1);
+
+      const size_t n = count < 16? count : 16;
+      for ( size_t k = 0; k < n; ++k )
+        out[k] = normals[k];
+
+      out += n;
+      count -= n;
+    }
+  }
+}
+
+extern "C" void rand_normal_array_r(MTState* s, float* out, size_t count)
+{
+  normal_array(*s, out, count);
+}
+
+extern "C" void rand_normal_array(float* out, size_t count)
+{
+  normal_array(state, out, count);
+}
+
+static void bernoulli_mask(MTState& s, uint32_t* out, size_t words, double p)
+{
+  /*
+   * Each bit of a tempered number is a fair coin flip, so for p = 1/2 the
+   * numbers themselves are the mask.  Any other p is rounded to a multiple of
+   * 2^-16 and built up one binary digit at a time, from the least significant
+   * one: a set digit ORs in a fresh word, a clear digit ANDs one in, which
+   * maps the probability of a set bit from q to (1 + q)/2 or q/2.  That costs
+   * one word per significant digit of p for 32 output bits (p = 0.25 needs
+   * two, p = 0.1 needs fifteen), and every pass is a plain vectorized loop
+   * over the block.
+   */
+  static const size_t CHUNK = 256;
+
+  const double scaled = floor(p * 65536.0 + 0.5);
+  uint32_t digits = scaled <= 0? 0 : scaled >= 65536? 65536 : uint32_t(scaled);
+
+  if ( digits == 0 || digits == 65536 ) {
+    const uint32_t fill = digits? 0xffffffff : 0;
+    for ( size_t n = 0; n < words; ++n )
+      out[n] = fill;
+    return;
+  }
+
+  // The lowest set digit starts the mask off as a plain random word
+  const int first = __builtin_ctz(digits);
+
+  while ( words > 0 ) {
+    const size_t chunk = words < CHUNK? words : CHUNK;
+
+    for ( size_t done = 0; done < chunk; ) {
+      size_t n = chunk - done;
+      const uint32_t* r = take_block(s, n);
+      for ( size_t k = 0; k < n; ++k )
+        out[done + k] = r[k];
+      done += n;
+    }
+
+    for ( int bit = first + 1; bit < 16; ++bit ) {
+      const bool set = (digits >> bit) & 1;
+
+      for ( size_t done = 0; done < chunk; ) {
+        size_t n = chunk - done;
+        const uint32_t* r = take_block(s, n);
+        uint32_t* m = out + done;
+
+        if ( set ) {
+          for ( size_t k = 0; k < n; ++k )
+            m[k] |= r[k];
+        } else {
+          for ( size_t k = 0; k < n; ++k )
+            m[k] &= r[k];
+        }
+
+        done += n;
+      }
+    }
+
+    out += chunk;
+    words -= chunk;
+  }
+}
+
+extern "C" void rand_mask_r(MTState* s, uint32_t* out, size_t words, double p)
+{
+  bernoulli_mask(*s, out, words, p);
+}
+
+extern "C" void rand_mask(uint32_t* out, size_t words, double p)
+{
+  bernoulli_mask(state, out, words, p);
+}
+
+/*
+ * Buffers at least this large are written with non-temporal stores.  By
+ * default that's the size of the last-level cache, since anything bigger
+ * would only evict the caller's working set on its way to memory.
+ */
+static size_t llc_bytes()
+{
+  long llc = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if ( llc <= 0 )
+    llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  return llc > 0? size_t(llc) : 8*1024*1024;
+}
+
+// Atomic, since rand_bytes_r() may run on other threads while this changes
+static std::atomic<size_t> stream_threshold_override(0);
+
+static size_t stream_threshold()
+{
+  const size_t bytes =
+    stream_threshold_override.load(std::memory_order_relaxed);
+
+  if ( bytes > 0 )
+    return bytes;
+
+  // Thread-safe initialization, once
+  static const size_t llc = llc_bytes();
+  return llc;
+}
+
+extern "C" void rand_bytes_stream_threshold(size_t bytes)
+{
+  stream_threshold_override.store(bytes, std::memory_order_relaxed);
+}
+
+// Copy 16 bytes to a 16-byte aligned destination
+static inline void store16(uint8_t* out, const uint8_t* in, bool stream)
+{
+#ifdef __SSE2__
+  const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+  if ( stream )
+    _mm_stream_si128(reinterpret_cast<__m128i*>(out), x);
+  else
+    _mm_store_si128(reinterpret_cast<__m128i*>(out), x);
+#else
+  (void)stream;
+  memcpy(out, in, 16);
+#endif
+}
+
+static void fill_bytes(MTState& s, void* dst, size_t len)
+{
+  /*
+   * The output is the tempered block viewed as bytes, so it is the same as
+   * copying out successive rand_u32() numbers in native byte order.  We keep
+   * a byte cursor into the block and only round it up to a whole number when
+   * we're done, dropping the unused bytes of the last one.
+   *
+   * After an unaligned head, the body is written 16 bytes at a time to
+   * aligned addresses straight from the block, using non-temporal stores for
+   * large buffers.  The 16 bytes that straddle two blocks go via a buffer.
+   */
+  static const size_t END = SIZE * sizeof(uint32_t);
+
+  const bool stream = len >= stream_threshold();
+
+  uint8_t* out = static_cast<uint8_t*>(dst);
+  const uint8_t* block = reinterpret_cast<const uint8_t*>(s.MT_TEMPERED);
+  size_t c = s.index * sizeof(uint32_t);
+
+  size_t head = (16 - (reinterpret_cast<uintptr_t>(out) & 15)) & 15;
+  if ( head > len )
+    head = len;
+
+  for ( len -= head; head > 0; --head ) {
+    if ( c == END ) {
+      generate_numbers(s);
+      c = 0;
+    }
+    *out++ = block[c++];
+  }
+
+  while ( len >= 16 ) {
+    if ( END - c >= 16 ) {
+      size_t chunks = (END - c) / 16;
+      if ( chunks > len / 16 )
+        chunks = len / 16;
+
+      for ( size_t n = 0; n < chunks; ++n, c += 16, out += 16 )
+        store16(out, block + c, stream);
+
+      len -= 16*chunks;
+    } else {
+      uint8_t seam[16];
+      const size_t left = END - c;
+
+      memcpy(seam, block + c, left);
+      generate_numbers(s);
+      memcpy(seam + left, block, 16 - left);
+      c = 16 - left;
+
+      store16(out, seam, stream);
+      out += 16;
+      len -= 16;
+    }
+  }
+
+#ifdef __SSE2__
+  if ( stream )
+    _mm_sfence();
+#endif
+
+  for ( ; len > 0; --len ) {
+    if ( c == END ) {
+      generate_numbers(s);
+      c = 0;
+    }
+    *out++ = block[c++];
+  }
+
+  s.index = (c + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+}
+
+extern "C" void rand_bytes_r(MTState* s, void* dst, size_t len)
+{
+  fill_bytes(*s, dst, len);
+}
+
+extern "C" void rand_bytes(void* dst, size_t len)
+{
+  fill_bytes(state, dst, len);
 }
@@ -19,21 +19,381 @@
 #define MERSENNE_TWISTER_H
 
 #define __STDC_LIMIT_MACROS
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * The complete state of one generator.  The functions without an _r suffix
+ * all share a single global instance; each of them has an _r version that
+ * takes a pointer to an MTState of its own as the first argument instead,
+ * so that for instance every thread can have its own generator.
+ *
+ * An MTState must be seeded with seed_r() before use.
+ *
+ * An MTState needs no more than the alignment of its members, so it can come
+ * from malloc, new, the stack or the inside of another struct.  It is padded
+ * to a whole number of 64-byte cache lines, though, and both arrays start a
+ * whole number of lines into it.  So when a state starts on a cache line, as
+ * the global one and those from state_arena_alloc() and state_node_alloc()
+ * do, each array starts on a line of its own.
+ */
+typedef struct MTState {
+  uint32_t MT[624];
+  uint32_t MT_TEMPERED[624];
+  size_t index;
+  uint8_t reserved[64 - sizeof(size_t)];
+} MTState;
+
 /*
  * Extract a pseudo-random unsigned 32-bit integer in the range 0 ... UINT32_MAX
  */
 uint32_t rand_u32();
+uint32_t rand_u32_r(MTState* state);
+
+/*
+ * Same as rand_u32() and rand_u32_r(), but inline, so that a loop can keep
+ * the index in a register and only pays for a call every 624 numbers, when
+ * rand_u32_refill_r() refills the block.
+ */
+extern MTState mt_global_state;
+uint32_t rand_u32_refill_r(MTState* state);
+
+static inline uint32_t rand_u32_fast_r(MTState* state)
+{
+#if defined(__GNUC__)
+  if ( __builtin_expect(state->index < 624, 1) )
+#else
+  if ( state->index < 624 )
+#endif
+    return state->MT_TEMPERED[state->index++];
+
+  return rand_u32_refill_r(state);
+}
+
+static inline uint32_t rand_u32_fast()
+{
+  return rand_u32_fast_r(&mt_global_state);
+}
 
 /*
  * Initialize Mersenne Twister with given seed value.
  */
 void seed(uint32_t seed_value);
+void seed_r(MTState* state, uint32_t seed_value);
+
+/*
+ * Seed states[0 ... count-1] with values[0 ... count-1], the same as calling
+ * seed_r() on each, but several at a time, which is faster.
+ */
+void seed_batch_r(MTState* states, const uint32_t* values, size_t count);
+
+/*
+ * Skip the next count numbers, as if rand_u32() had been called count times.
+ * Skipped blocks are only twisted, not tempered, but this still takes time
+ * proportional to count.
+ */
+void discard(uint64_t count);
+void discard_r(MTState* state, uint64_t count);
+
+/*
+ * Allocate zeroed memory for count states, packed into 2 MiB huge pages so
+ * that a large number of generators needs few TLB entries.  Explicit huge
+ * pages (MAP_HUGETLB) are used if the system has any reserved; otherwise the
+ * memory is 2 MiB aligned and advised for transparent huge pages.  If
+ * huge_pages is not NULL, it is set to 2, 1 or 0 for explicit huge pages,
+ * advised transparent ones, or neither.  Returns NULL if out of memory.
+ *
+ * The states must still be seeded, e.g. with seed_batch_r().  Release them
+ * with state_arena_free() and the same count.
+ */
+MTState* state_arena_alloc(size_t count, int* huge_pages);
+void state_arena_free(MTState* states, size_t count);
+
+/*
+ * NUMA placement.  state_node_alloc() allocates count states whose memory is
+ * bound to the given node, or to the calling thread's node if node < 0, to
+ * be released with state_node_free().  It returns NULL if out of memory or
+ * if the memory can't be bound to the given node, e.g. because the node
+ * doesn't exist or is offline, or the system has no NUMA support.  For the
+ * calling thread's node, binding is only attempted, as the memory is placed
+ * there on first touch anyway.  state_node() tells which node a state is on
+ * (-1 if unknown, e.g. not touched yet) and current_node() which node the
+ * calling thread runs on.
+ *
+ * thread_state() gives each thread a generator of its own.  On the first call
+ * from a thread it is allocated on that thread's node and seeded with
+ * seed_value, which later calls ignore.  It is freed when the thread exits.
+ */
+MTState* state_node_alloc(size_t count, int node);
+void state_node_free(MTState* states, size_t count);
+int state_node(const MTState* state);
+int current_node();
+MTState* thread_state(uint32_t seed_value);
+
+/*
+ * Compact generators for when there are too many for a whole MTState each.
+ * An MTCompact holds only the 624-word state and an index, padded to 2560
+ * bytes (40 cache lines), half of an MTState.  It gives the same numbers as an MTState with
+ * the same seed.
+ *
+ * To draw from one, make it the active state of an MTScratch, of which each
+ * thread needs one of its own, with compact_select().  The scratch area then
+ * holds the 16 tempered numbers of the cache line being drawn from, so
+ * switching between states is cheap and only what is drawn gets tempered.
+ * Select another state, or NULL, before a state is used by another thread.
+ * An MTScratch starts out zeroed.
+ *
+ * A state can be reseeded with compact_seed() at any time.  If it is active,
+ * select it again afterwards: until then, the scratch area still hands out
+ * what is left of the cache line it tempered before the reseed.
+ */
+typedef struct MTCompact {
+  uint32_t MT[624];
+  uint32_t index;
+  uint8_t reserved[60];
+} MTCompact;
+
+typedef struct MTScratch {
+  uint32_t words[16];
+  MTCompact* active;
+  uint32_t pos;
+  uint32_t end;
+} MTScratch;
+
+void compact_seed(MTCompact* state, uint32_t seed_value);
+void compact_select(MTScratch* scratch, MTCompact* state);
+uint32_t compact_refill(MTScratch* scratch);
+
+// Same as rand_u32_r(), from the active state of scratch
+static inline uint32_t compact_rand_u32(MTScratch* scratch)
+{
+  if ( scratch->pos < scratch->end )
+    return scratch->words[scratch->pos++];
+
+  return compact_refill(scratch);
+}
+
+// Like state_arena_alloc(), but for compact states
+MTCompact* compact_arena_alloc(size_t count, int* huge_pages);
+void compact_arena_free(MTCompact* states, size_t count);
+
+/*
+ * Incremental generators, for callers that can't afford the occasional slow
+ * call.  An MTState twists and tempers the whole block on every 624th call,
+ * which stands out in the tail latency.  An MTIncremental twists and tempers
+ * just the next 16 words on every 16th call instead, so the work per call is
+ * small and the same all the way through the block.  It gives the same
+ * numbers as an MTState with the same seed.
+ */
+typedef struct MTIncremental {
+  uint32_t MT[624];
+  uint32_t words[16];
+  uint32_t pos;
+  uint32_t next;
+} MTIncremental;
+
+void incremental_seed(MTIncremental* state, uint32_t seed_value);
+uint32_t incremental_refill(MTIncremental* state);
+
+// Same as rand_u32_r(), with a refill every 16 numbers
+static inline uint32_t incremental_rand_u32(MTIncremental* state)
+{
+  if ( state->pos < 16 )
+    return state->words[state->pos++];
+
+  return incremental_refill(state);
+}
+
+/*
+ * Lookahead generators, for bulk consumers.  An MTLookahead generates
+ * `blocks` blocks of 624 numbers back to back in one refill, carrying the
+ * state from one block to the next, instead of one block at a time.  It gives
+ * the same numbers as an MTState with the same seed.
+ *
+ * lookahead_init() allocates the buffers, about 5 KB per block, and seeds the
+ * generator.  It returns 0 on success and -1 if blocks is zero or memory runs
+ * out.  Release the buffers with lookahead_free().
+ */
+typedef struct MTLookahead {
+  const uint32_t* next;
+  const uint32_t* end;
+  uint32_t* tempered;
+  uint32_t* window;
+  size_t blocks;
+} MTLookahead;
+
+int lookahead_init(MTLookahead* state, size_t blocks, uint32_t seed_value);
+void lookahead_free(MTLookahead* state);
+void lookahead_seed(MTLookahead* state, uint32_t seed_value);
+uint32_t lookahead_refill(MTLookahead* state);
+
+// Same as rand_u32_r(), with a refill every 624*blocks numbers
+static inline uint32_t lookahead_rand_u32(MTLookahead* state)
+{
+  if ( state->next < state->end )
+    return *state->next++;
+
+  return lookahead_refill(state);
+}
+
+// Same as rand_u32_array_r()
+void lookahead_u32_array(MTLookahead* state, uint32_t* out, size_t count);
+
+/*
+ * Copy the global state out to *out, or replace it with *in.  Restoring a
+ * snapshot is much cheaper than seeding, and an MTState can be copied around
+ * freely, so the same goes for the _r functions.
+ */
+void get_state(MTState* out);
+void set_state(const MTState* in);
+
+/*
+ * Extract an unbiased pseudo-random integer in the range 0 ... range-1.
+ */
+uint32_t rand_below(uint32_t range);
+uint32_t rand_below_r(MTState* state, uint32_t range);
+
+/*
+ * Shuffle array[0 ... count-1] in place (Fisher-Yates).
+ *
+ * Gives the same permutation as swapping array[i] with array[rand_below(i+1)]
+ * for i = count-1 down to 1, but draws the swap targets in batches and
+ * prefetches them, which is much faster for arrays that don't fit in cache.
+ * That only holds for count < 2^32, since rand_below() takes a 32-bit range:
+ * where i+1 >= 2^32, the target is drawn from two numbers instead, the first
+ * one as the high 32 bits.
+ */
+void rand_shuffle_u32(uint32_t* array, size_t count);
+void rand_shuffle_u32_r(MTState* state, uint32_t* array, size_t count);
+
+/*
+ * Draw k distinct indices from 0 ... n-1, written to out[0 ... k-1] in
+ * increasing order (Vitter's Method D).  Uses O(k) random numbers, no matter
+ * how large n is.  Does nothing unless 0 < k <= n.
+ */
+void rand_sample(uint64_t* out, size_t k, uint64_t n);
+void rand_sample_r(MTState* state, uint64_t* out, size_t k, uint64_t n);
+
+/*
+ * Reservoir sampling of k items from a stream of unknown length, using Li's
+ * Algorithm L.  Fill the reservoir with items 0 ... k-1, then call
+ * reservoir_init().  After that, item number r.next (counting from zero) is
+ * the next one to keep: store it at reservoir_slot(&r), which then advances
+ * r.next.  All items in between can be skipped without looking at them, so
+ * the number of random numbers drawn grows with k log(n/k), not n.
+ *
+ * With k = 0 nothing is drawn and r.next is UINT64_MAX, so no item is ever
+ * kept; reservoir_slot() then returns 0 without drawing.
+ */
+typedef struct Reservoir {
+  uint64_t next;
+  double w;
+  uint32_t k;
+} Reservoir;
+
+void reservoir_init(Reservoir* r, uint32_t k);
+void reservoir_init_r(MTState* state, Reservoir* r, uint32_t k);
+uint32_t reservoir_slot(Reservoir* r);
+uint32_t reservoir_slot_r(MTState* state, Reservoir* r);
+
+/*
+ * Fill out[0 ... words-1] with random bits that are each set with probability
+ * p, independently.  p is rounded to the nearest multiple of 2^-16.
+ *
+ * Uses every bit of the generated numbers: p = 1/2 copies them out directly,
+ * and in general it takes one number per significant binary digit of p for
+ * each 32 output bits.
+ */
+void rand_mask(uint32_t* out, size_t words, double p);
+void rand_mask_r(MTState* state, uint32_t* out, size_t words, double p);
+
+/*
+ * Fill out[0 ... count-1] with the next count rand_u32() numbers, copied
+ * straight out of the generator's block.
+ */
+void rand_u32_array(uint32_t* out, size_t count);
+void rand_u32_array_r(MTState* state, uint32_t* out, size_t count);
+
+/*
+ * Borrow up to *count of the next numbers straight from the generator's block,
+ * without copying them out.  Returns a pointer to them and sets *count to how
+ * many there are, which is fewer than asked for if the block ends first (but
+ * never zero, unless zero were asked for).  The numbers count as drawn, and
+ * the pointer stays valid until the next call that draws from the same state.
+ *
+ * To process a long run of numbers in place, call this in a loop until
+ * enough have been borrowed.
+ */
+const uint32_t* rand_u32_borrow(size_t* count);
+const uint32_t* rand_u32_borrow_r(MTState* state, size_t* count);
+
+/*
+ * Fill out[0 ... count-1] with uniform doubles in [0, 1) with 53 bits of
+ * resolution, the same as genrand_res53() in the reference implementation.
+ * Each double consumes two numbers from the generator.
+ */
+void rand_double_array(double* out, size_t count);
+void rand_double_array_r(MTState* state, double* out, size_t count);
+
+/*
+ * Fill dst[0 ... len-1] with pseudo-random bytes.
+ *
+ * The bytes are the same as those of successive rand_u32() numbers in native
+ * byte order; a number that is only partly used is discarded.  Buffers at
+ * least as large as the last-level cache are written with non-temporal
+ * stores so that they don't evict the rest of the working set.
+ */
+void rand_bytes(void* dst, size_t len);
+void rand_bytes_r(MTState* state, void* dst, size_t len);
+
+/*
+ * Override the buffer size from which rand_bytes uses non-temporal stores.
+ * Zero restores the default, which is the size of the last-level cache.
+ */
+void rand_bytes_stream_threshold(size_t bytes);
+
+/*
+ * Fill out[0 ... count-1] with standard normal deviates (mean 0, variance 1).
+ *
+ * Uses a vectorized Box-Muller transform that turns each group of 16 tempered
+ * words into 16 normals, reading directly from the generator's block.  The
+ * absolute error against an exact transform of the same words is below 2e-6.
+ * Every started group of 16 normals consumes 16 numbers from the generator.
+ *
+ * The angles use 24 bits of a word.  So do the radii, except that words
+ * below 2^24 use all 32 bits, so the largest |z| is sqrt(64 ln 2) = 6.66.
+ * Larger deviates, which a double-precision transform would reach about once
+ * in 4e10 normals, never occur.
+ */
+void rand_normal_array(float* out, size_t count);
+void rand_normal_array_r(MTState* state, float* out, size_t count);
+
+/*
+ * The twist that refills the state comes in several kernels: the scalar loop
+ * at different unroll factors, and SSE2/AVX2 versions when the compiler
+ * targets those.  They all produce the same numbers; which one is fastest
+ * depends on the CPU.  The initial kernel can be chosen by name with the
+ * MT_KERNEL environment variable or, at build time, with -DMT_KERNEL='"name"'.
+ * The kernel is shared by all states.
+ */
+size_t kernel_count();
+const char* kernel_name(size_t index);
+const char* kernel_current();
+
+/*
+ * Select a kernel by name.  Returns 0 on success and -1 if there is no such
+ * kernel, in which case the current one is kept.
+ */
+int kernel_select(const char* name);
+
+/*
+ * Time every kernel on this machine, select the fastest and return its name.
+ */
+const char* kernel_tune();
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,220 @@
+/*
+ * Jump-ahead for the reentrant reference generator in mt19937ar-r.h.
+ *
+ * MT19937 is linear over GF(2): one step of the recurrence is a matrix T
+ * acting on the 19937-bit state.  If phi(t) is the characteristic polynomial
+ * of T and g(t) = t^J mod phi(t), then T^J = g(T) (Cayley-Hamilton), so the
+ * state J steps ahead is the sum of g_i T^i(state), which Horner's rule gives
+ * with 19937 single steps instead of J.
+ *
+ * phi is found once, with the Berlekamp-Massey algorithm, from 2*19937 bits
+ * of one output bit; since phi is irreducible, that bit sequence has phi as
+ * its minimal polynomial.  See Haramoto, Matsumoto, Nishimura, Panneton and
+ * L'Ecuyer, "Efficient jump ahead for F2-linear random number generators"
+ * (2008).
+ *
+ * Needs <stdint.h> and <vector>, and mt19937ar-r.h included before it.
+ */
+
+#ifndef MT19937AR_JUMP_H
+#define MT19937AR_JUMP_H
+
+// Polynomials over GF(2), with the coefficient of t^i in bit i
+typedef std::vector<uint64_t> gf2_poly;
+
+static inline bool gf2_bit(const gf2_poly& p, size_t i)
+{
+  return (p[i/64] >> (i%64)) & 1;
+}
+
+static inline void gf2_flip(gf2_poly& p, size_t i)
+{
+  p[i/64] ^= uint64_t(1) << (i%64);
+}
+
+// p ^= q * t^shift, where q has `bits` coefficients
+static void gf2_xor_shifted(gf2_poly& p, const gf2_poly& q, size_t bits,
+    size_t shift)
+{
+  const size_t words = (bits + 63) / 64;
+  const size_t w = shift / 64, b = shift % 64;
+
+  for ( size_t k = 0; k < words && w + k < p.size(); ++k ) {
+    p[w + k] ^= q[k] << b;
+    if ( b != 0 && w + k + 1 < p.size() )
+      p[w + k + 1] ^= q[k] >> (64 - b);
+  }
+}
+
+// Ring of the last 624 words of the recurrence, oldest at mt[p]
+struct genrand_ring {
+  uint32_t mt[624];
+  size_t p;
+};
+
+static inline void genrand_ring_step(genrand_ring& r)
+{
+  const size_t N = 624, M = 397;
+  const size_t p = r.p, p1 = p + 1 < N? p + 1 : 0;
+  const size_t pm = p + M < N? p + M : p + M - N;
+
+  const uint32_t y = (r.mt[p] & 0x80000000u) | (r.mt[p1] & 0x7fffffffu);
+  r.mt[p] = r.mt[pm] ^ (y >> 1) ^ ((y & 1)? 0x9908b0dfu : 0);
+  r.p = p1;
+}
+
+static inline void genrand_ring_xor(genrand_ring& r, const genrand_ring& s)
+{
+  for ( size_t i = 0, a = r.p, b = s.p; i < 624; ++i ) {
+    r.mt[a] ^= s.mt[b];
+    a = a + 1 < 624? a + 1 : 0;
+    b = b + 1 < 624? b + 1 : 0;
+  }
+}
+
+/*
+ * Characteristic polynomial of the MT19937 recurrence, found with
+ * Berlekamp-Massey over the lowest bit of successive state words.
+ */
+static const gf2_poly& genrand_charpoly(size_t& degree)
+{
+  static const size_t MEXP = 19937;
+  static gf2_poly phi;
+  static size_t L = 0;
+
+  if ( L == 0 ) {
+    const size_t n2 = 2*MEXP;
+    const size_t words = n2/64 + 2;
+
+    // The sequence, reversed: bit j of rev is s[n2-1-j]
+    genrand_ring ring;
+    ring.p = 0;
+    ring.mt[0] = 5489;
+    for ( size_t i = 1; i < 624; ++i )
+      ring.mt[i] = 1812433253u * (ring.mt[i-1] ^ (ring.mt[i-1] >> 30)) + i;
+
+    gf2_poly rev(words, 0);
+    for ( size_t i = 0; i < n2; ++i ) {
+      if ( ring.mt[ring.p < 623? ring.p + 1 : 0] & 1 )
+        gf2_flip(rev, n2 - 1 - i);
+      genrand_ring_step(ring);
+    }
+
+    // C is the connection polynomial, B the one before the last change
+    gf2_poly C(words, 0), B(words, 0), T;
+    C[0] = B[0] = 1;
+    size_t shift = 1;  // Steps since B was last replaced
+    L = 0;
+
+    for ( size_t n = 0; n < n2; ++n ) {
+      // d = s[n] + sum c_i s[n-i] = parity of C & (bits s[n], s[n-1], ...)
+      const size_t base = n2 - 1 - n;  // bit of rev holding s[n]
+      uint64_t acc = 0;
+
+      for ( size_t k = 0; k <= L/64; ++k ) {
+        const size_t bit = base + 64*k;
+        const size_t w = bit / 64, b = bit % 64;
+        uint64_t window = rev[w] >> b;
+        if ( b != 0 && w + 1 < rev.size() )
+          window |= rev[w + 1] << (64 - b);
+        acc ^= C[k] & window;
+      }
+
+      // Coefficients of C above L are zero, so the overshoot doesn't matter
+      if ( !__builtin_parityll(acc) ) {
+        ++shift;
+      } else if ( 2*L <= n ) {
+        T = C;
+        gf2_xor_shifted(C, B, L + 1, shift);
+        L = n + 1 - L;
+        B = T;
+        shift = 1;
+      } else {
+        gf2_xor_shifted(C, B, L + 1, shift);
+        ++shift;
+      }
+    }
+
+    // phi(t) = t^L C(1/t)
+    phi.assign(L/64 + 1, 0);
+    for ( size_t i = 0; i <= L; ++i ) {
+      if ( gf2_bit(C, i) )
+        gf2_flip(phi, L - i);
+    }
+  }
+
+  degree = L;
+  return phi;
+}
+
+// t^J mod phi, by square-and-multiply
+static gf2_poly genrand_jump_poly(uint64_t J)
+{
+  size_t L;
+  const gf2_poly& phi = genrand_charpoly(L);
+
+  gf2_poly r(L/64 + 1, 0);
+  r[0] = 1;
+
+  // Reduce a polynomial of degree below 2L modulo phi, in place
+  auto reduce = [&](gf2_poly& p) {
+    for ( size_t d = 2*L; d-- > L; ) {
+      if ( gf2_bit(p, d) )
+        gf2_xor_shifted(p, phi, L + 1, d - L);
+    }
+    p.resize(L/64 + 1);
+  };
+
+  for ( int bit = 63; bit >= 0; --bit ) {
+    // Squaring over GF(2) spreads the coefficients out: t^i -> t^2i
+    gf2_poly sq(2*(L/64 + 1) + 1, 0);
+    for ( size_t i = 0; i < L; ++i ) {
+      if ( gf2_bit(r, i) )
+        gf2_flip(sq, 2*i);
+    }
+    reduce(sq);
+    r = sq;
+
+    if ( (J >> bit) & 1 ) {
+      gf2_poly t(2*(L/64 + 1) + 1, 0);
+      gf2_xor_shifted(t, r, L, 1);
+      reduce(t);
+      r = t;
+    }
+  }
+
+  return r;
+}
+
+/*
+ * Advance a freshly twisted or seeded state (mti == N) by J numbers, leaving
+ * it so that the next genrand_int32_r() returns what would have been number J
+ * from here.
+ */
+static void genrand_jump_r(genrand_state* st, uint64_t J)
+{
+  size_t L;
+  genrand_charpoly(L);
+  const gf2_poly g = genrand_jump_poly(J);
+
+  genrand_ring s, r;
+  s.p = r.p = 0;
+  for ( size_t i = 0; i < 624; ++i ) {
+    s.mt[i] = uint32_t(st->mt[i]);
+    r.mt[i] = 0;
+  }
+
+  // r = g(T) s, by Horner's rule
+  for ( size_t i = L; i-- > 0; ) {
+    genrand_ring_step(r);
+    if ( gf2_bit(g, i) )
+      genrand_ring_xor(r, s);
+  }
+
+  for ( size_t i = 0; i < 624; ++i )
+    st->mt[i] = r.mt[(r.p + i) % 624];
+
+  st->mti = 624;
+}
+
+#endif // MT19937AR_JUMP_H
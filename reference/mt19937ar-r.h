@@ -0,0 +1,96 @@
+/*
+   A reentrant version of genrand_int32() and friends from mt19937ar.cpp,
+   for checking many generators at once from several threads.  The state is
+   passed in explicitly; the code is otherwise the same as the original.
+
+   Copyright (C) 1997 - 2002, Makoto Matsumoto and Takuji Nishimura,
+   All rights reserved.
+
+   See mt19937ar.h for the full license text.
+*/
+
+#ifndef MT19937AR_R_H
+#define MT19937AR_R_H
+
+#define MT19937AR_N 624
+#define MT19937AR_M 397
+#define MT19937AR_MATRIX_A 0x9908b0dfUL   /* constant vector a */
+#define MT19937AR_UPPER_MASK 0x80000000UL /* most significant w-r bits */
+#define MT19937AR_LOWER_MASK 0x7fffffffUL /* least significant r bits */
+
+typedef struct genrand_state {
+    unsigned long mt[MT19937AR_N]; /* the array for the state vector  */
+    int mti; /* mti==N+1 means mt[N] is not initialized */
+} genrand_state;
+
+/* initializes mt[N] with a seed */
+static inline void init_genrand_r(genrand_state* st, unsigned long s)
+{
+    unsigned long* mt = st->mt;
+    int mti;
+
+    mt[0]= s & 0xffffffffUL;
+    for (mti=1; mti<MT19937AR_N; mti++) {
+        mt[mti] =
+	    (1812433253UL * (mt[mti-1] ^ (mt[mti-1] >> 30)) + mti);
+        mt[mti] &= 0xffffffffUL;
+        /* for >32 bit machines */
+    }
+
+    st->mti = mti;
+}
+
+/* generates a random number on [0,0xffffffff]-interval */
+static inline unsigned long genrand_int32_r(genrand_state* st)
+{
+    unsigned long* mt = st->mt;
+    unsigned long y;
+    static const unsigned long mag01[2]={0x0UL, MT19937AR_MATRIX_A};
+    /* mag01[x] = x * MATRIX_A  for x=0,1 */
+
+    if (st->mti >= MT19937AR_N) { /* generate N words at one time */
+        const int N = MT19937AR_N, M = MT19937AR_M;
+        int kk;
+
+        if (st->mti == N+1)   /* if init_genrand() has not been called, */
+            init_genrand_r(st, 5489UL); /* a default initial seed is used */
+
+        for (kk=0;kk<N-M;kk++) {
+            y = (mt[kk]&MT19937AR_UPPER_MASK)|(mt[kk+1]&MT19937AR_LOWER_MASK);
+            mt[kk] = mt[kk+M] ^ (y >> 1) ^ mag01[y & 0x1UL];
+        }
+        for (;kk<N-1;kk++) {
+            y = (mt[kk]&MT19937AR_UPPER_MASK)|(mt[kk+1]&MT19937AR_LOWER_MASK);
+            mt[kk] = mt[kk+(M-N)] ^ (y >> 1) ^ mag01[y & 0x1UL];
+        }
+        y = (mt[N-1]&MT19937AR_UPPER_MASK)|(mt[0]&MT19937AR_LOWER_MASK);
+        mt[N-1] = mt[M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
+
+        st->mti = 0;
+    }
+
+    y = mt[st->mti++];
+
+    /* Tempering */
+    y ^= (y >> 11);
+    y ^= (y << 7) & 0x9d2c5680UL;
+    y ^= (y << 15) & 0xefc60000UL;
+    y ^= (y >> 18);
+
+    return y;
+}
+
+/* generates a random number on [0,1) with 53-bit resolution*/
+static inline double genrand_res53_r(genrand_state* st)
+{
+    unsigned long a=genrand_int32_r(st)>>5, b=genrand_int32_r(st)>>6;
+    return(a*67108864.0+b)*(1.0/9007199254740992.0);
+}
+
+#undef MT19937AR_N
+#undef MT19937AR_M
+#undef MT19937AR_MATRIX_A
+#undef MT19937AR_UPPER_MASK
+#undef MT19937AR_LOWER_MASK
+
+#endif /* MT19937AR_R_H */
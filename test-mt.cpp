@@ -15,56 +15,402 @@
 #define __STDC_FORMAT_MACROS
 #include <float.h>
 #include <inttypes.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <math.h>
+#include <mutex>
+#include <pthread.h>
+#include <random>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <sys/resource.h>
+#include <thread>
+#include <time.h>
 #include <vector>
 
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+# define HAVE_TSC 1
+# include <cpuid.h>
+# include <x86intrin.h>
+#endif
+
 namespace mt {
   #include "mersenne-twister.h"
 }
 
 namespace reference {
   #include "reference/mt19937ar.h"
+  #include "reference/mt19937ar-r.h"
+  #include "reference/mt19937ar-jump.h"
+}
+
+/*
+ * Optional hardware performance counters, read with perf_event_open(2) for
+ * each benchmark pass.  Every event is opened on its own, counting user space
+ * only, so that whatever the kernel, CPU or perf_event_paranoid setting
+ * doesn't allow is simply left out.
+ */
+enum PerfEvent {
+  PERF_INSTRUCTIONS,
+  PERF_CYCLES,
+  PERF_L1D_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_STORE_FORWARD,
+  PERF_EVENTS
+};
+
+static const char* perf_event_names[PERF_EVENTS] = {
+  "instructions",
+  "cycles",
+  "L1D read misses",
+  "branch misses",
+  "store-forward blocks"
+};
+
+static bool use_perf = false;
+
+struct PerfCounters {
+  int fd[PERF_EVENTS];
+
+  PerfCounters()
+  {
+    for ( int n = 0; n < PERF_EVENTS; ++n )
+      fd[n] = -1;
+  }
+
+  ~PerfCounters()
+  {
+    close();
+  }
+
+  bool available() const
+  {
+    for ( int n = 0; n < PERF_EVENTS; ++n )
+      if ( fd[n] >= 0 )
+        return true;
+    return false;
+  }
+
+  bool open();
+  void close();
+  void start();
+  void stop(double values[PERF_EVENTS]);
+};
+
+#ifdef __linux__
+static int perf_open(uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static bool is_intel()
+{
+#ifdef HAVE_TSC
+  unsigned eax, ebx, ecx, edx;
+  if ( !__get_cpuid(0, &eax, &ebx, &ecx, &edx) )
+    return false;
+
+  // "GenuineIntel"
+  return ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e;
+#else
+  return false;
+#endif
 }
 
+bool PerfCounters::open()
+{
+  fd[PERF_INSTRUCTIONS] = perf_open(PERF_TYPE_HARDWARE,
+      PERF_COUNT_HW_INSTRUCTIONS);
+  fd[PERF_CYCLES] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  fd[PERF_L1D_MISSES] = perf_open(PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_L1D |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  fd[PERF_BRANCH_MISSES] = perf_open(PERF_TYPE_HARDWARE,
+      PERF_COUNT_HW_BRANCH_MISSES);
+
+  // There's no generic event for this; LD_BLOCKS.STORE_FORWARD on Intel
+  if ( is_intel() )
+    fd[PERF_STORE_FORWARD] = perf_open(PERF_TYPE_RAW, 0x0203);
+
+  return available();
+}
+
+void PerfCounters::close()
+{
+  for ( int n = 0; n < PERF_EVENTS; ++n ) {
+    if ( fd[n] >= 0 )
+      ::close(fd[n]);
+    fd[n] = -1;
+  }
+}
+
+void PerfCounters::start()
+{
+  for ( int n = 0; n < PERF_EVENTS; ++n ) {
+    if ( fd[n] >= 0 ) {
+      ioctl(fd[n], PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd[n], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void PerfCounters::stop(double values[PERF_EVENTS])
+{
+  for ( int n = 0; n < PERF_EVENTS; ++n ) {
+    values[n] = -1;
+
+    if ( fd[n] < 0 )
+      continue;
+
+    ioctl(fd[n], PERF_EVENT_IOC_DISABLE, 0);
+
+    // value, time enabled, time running; scale up if multiplexed
+    uint64_t data[3];
+    if ( read(fd[n], data, sizeof(data)) == sizeof(data) && data[2] > 0 )
+      values[n] = double(data[0]) * data[1] / data[2];
+  }
+}
+#else
+bool PerfCounters::open() { return false; }
+void PerfCounters::close() { }
+void PerfCounters::start() { }
+void PerfCounters::stop(double values[PERF_EVENTS])
+{
+  for ( int n = 0; n < PERF_EVENTS; ++n )
+    values[n] = -1;
+}
+#endif
+
+static PerfCounters perf;
+
 struct Benchmark {
+  std::string kernel;
   uint32_t hash;
   double best;
   std::vector<double> times;
+  std::vector<uint32_t> hashes;  // of each pass; hash is all of them XORed
   size_t its;
 
-  Benchmark() : hash(0xffffffff), best(9999999999), its(1)
+  // Hardware counters for each pass, -1 where unavailable
+  std::vector<double> counters[PERF_EVENTS];
+
+  // TSC cycles per refill, or zero if not measured
+  double refill_min;
+  double refill_median;
+  double refill_overhead;
+
+  Benchmark() : kernel("unnamed"), hash(0xffffffff), best(9999999999), its(1),
+    refill_min(0), refill_median(0), refill_overhead(0)
   {
   }
 };
 
+/*
+ * Timing backends.  getrusage gives user time with microsecond resolution,
+ * CLOCK_MONOTONIC_RAW gives wall time unaffected by NTP slewing, and the
+ * invariant TSC gives wall time in reference cycles, which is what we use to
+ * report cycles per number.
+ */
+enum TimerBackend {
+  TIMER_RUSAGE,
+  TIMER_MONOTONIC_RAW,
+  TIMER_TSC
+};
+
+static TimerBackend timer_backend = TIMER_RUSAGE;
+
+// TSC ticks per second, or zero if there is no usable TSC
+static double tsc_hz = 0;
+
+static inline uint64_t tsc_begin()
+{
+#ifdef HAVE_TSC
+  // Don't let earlier instructions drift past the read, nor later ones ahead
+  _mm_lfence();
+  const uint64_t t = __rdtsc();
+  _mm_lfence();
+  return t;
+#else
+  return 0;
+#endif
+}
+
+static inline uint64_t tsc_end()
+{
+#ifdef HAVE_TSC
+  // rdtscp waits for everything before it to finish
+  unsigned aux;
+  const uint64_t t = __rdtscp(&aux);
+  _mm_lfence();
+  return t;
+#else
+  return 0;
+#endif
+}
+
+static double monotonic_raw_secs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static bool has_invariant_tsc()
+{
+#ifdef HAVE_TSC
+  unsigned eax, ebx, ecx, edx;
+
+  if ( !__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007 )
+    return false;
+
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx >> 8) & 1;
+#else
+  return false;
+#endif
+}
+
+/*
+ * Measure the TSC frequency against CLOCK_MONOTONIC_RAW, taking the median of
+ * a few short busy-waits.  Leaves tsc_hz at zero if the TSC isn't invariant,
+ * since then it doesn't tick at a constant rate.
+ */
+static void calibrate_tsc()
+{
+  if ( !has_invariant_tsc() )
+    return;
+
+  double rates[5];
+
+  for ( int n = 0; n < 5; ++n ) {
+    const double start = monotonic_raw_secs();
+    const uint64_t ticks = tsc_begin();
+    double now;
+
+    while ( (now = monotonic_raw_secs()) - start < 0.02 )
+      ;
+
+    rates[n] = (tsc_end() - ticks) / (now - start);
+  }
+
+  std::sort(rates, rates + 5);
+  tsc_hz = rates[2];
+}
+
 struct Timer {
   double mark_;
 
-  Timer() : mark_(rusage_self())
+  Timer() : mark_(now())
   {
   }
 
-  double rusage_self() const
+  static double rusage_self()
   {
     struct rusage ru;
     getrusage(RUSAGE_SELF, &ru);
     return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0;
   }
 
+  static double now()
+  {
+    switch ( timer_backend ) {
+      case TIMER_TSC:
+        return tsc_end() / tsc_hz;
+      case TIMER_MONOTONIC_RAW:
+        return monotonic_raw_secs();
+      default:
+        return rusage_self();
+    }
+  }
+
   double elapsed_secs() const
   {
-    return rusage_self() - mark_;
+    return now() - mark_;
   }
 
   void reset()
   {
-    mark_ = rusage_self();
+    mark_ = now();
   }
 };
 
+static const char* timer_name()
+{
+  switch ( timer_backend ) {
+    case TIMER_TSC:
+      return "invariant TSC";
+    case TIMER_MONOTONIC_RAW:
+      return "CLOCK_MONOTONIC_RAW";
+    default:
+      return "getrusage user time";
+  }
+}
+
+/*
+ * Time passes of PASS(pass), which draws its numbers and returns something to
+ * fold into the hash.
+ */
+template<class PASS>
+static Benchmark time_passes(const int passes, const size_t subiterations,
+    PASS run_pass)
+{
+  Benchmark result;
+  result.its = subiterations;
+
+  for ( int pass = 0; pass < passes; ++pass ) {
+    double counters[PERF_EVENTS];
+
+    if ( use_perf )
+      perf.start();
+
+    Timer timer;
+    const uint32_t hash = run_pass(pass);
+    const double secs = timer.elapsed_secs();
+    result.hash ^= hash;
+    result.hashes.push_back(hash);
+    result.times.push_back(secs);
+
+    if ( use_perf ) {
+      perf.stop(counters);
+      for ( int n = 0; n < PERF_EVENTS; ++n )
+        result.counters[n].push_back(counters[n]);
+    }
+
+    if ( secs < result.best ) {
+      result.best = secs;
+      printf("\n  %9.7fs ", result.best);
+      fflush(stdout);
+    } else {
+      printf(".");
+      fflush(stdout);
+    }
+  }
+
+  return result;
+}
+
 template<class SEEDFUNC, class RANDFUNC>
 #if defined(__clang__)
   [[clang::optnone]]
@@ -129,27 +475,50 @@ static Benchmark benchmark_hashes(
     const int passes,
     const size_t subiterations)
 {
-  Benchmark result;
-  result.its = subiterations;
-
-  for ( int pass = 0; pass < passes; ++pass ) {
-    Timer timer;
+  return time_passes(passes, subiterations, [&](int pass) {
     // use a different seed each time
-    result.hash ^= benchmark_hash(pass*19, subiterations, set_seed, draw_u32);
-    const double secs = timer.elapsed_secs();
-    result.times.push_back(secs);
+    return benchmark_hash(pass*19, subiterations, set_seed, draw_u32);
+  });
+}
 
-    if ( secs < result.best ) {
-      result.best = secs;
-      printf("\n  %9.7fs ", result.best);
-      fflush(stdout);
-    } else {
-      printf(".");
-      fflush(stdout);
+/*
+ * Keep a value alive without de-optimizing the code that computes it, like
+ * Google Benchmark's DoNotOptimize.  Unlike there, there's no memory clobber,
+ * so the generator's state can stay in registers between draws, just as it
+ * would in the caller's own optimized loop.
+ */
+template<class T>
+static inline void do_not_optimize(const T& value)
+{
+  asm volatile("" : : "r,m"(value));
+}
+
+/*
+ * Same as benchmark_hashes, but with an optimized loop: the draws are inlined
+ * wherever the compiler can see them (the std:: engines) and every number is
+ * passed to do_not_optimize, so the hash isn't what keeps the loop alive.  The
+ * hashes come out the same as with benchmark_hashes.
+ */
+template<class SEEDFUNC, class RANDFUNC>
+static Benchmark benchmark_optimized(
+    SEEDFUNC set_seed,
+    RANDFUNC draw_u32,
+    const int passes = 15,
+    const size_t subiterations = 200000000ULL)
+{
+  return time_passes(passes, subiterations, [&](int pass) {
+    uint32_t hash = 0xffffffff;
+
+    set_seed(pass*19);
+
+    for ( size_t n = 0; n < subiterations; ++n ) {
+      const uint32_t value = draw_u32();
+      do_not_optimize(value);
+      hash ^= value;
     }
-  }
 
-  return result;
+    return hash;
+  });
 }
 
 static double mean(const std::vector<double>& v)
@@ -247,6 +616,40 @@ static void report(const Benchmark& res)
 
     printf("  %s — %s numbers/second\n", worst.c_str(), best.c_str());
 
+    if ( tsc_hz > 0 ) {
+      printf("  %.3f — %.3f TSC cycles/number (best — mean)\n",
+          min(res.times) * tsc_hz / res.its,
+          mean(res.times) * tsc_hz / res.its);
+    }
+
+    if ( !res.counters[0].empty() ) {
+      // Counters of the fastest pass
+      const size_t best = std::min_element(res.times.begin(),
+          res.times.end()) - res.times.begin();
+
+      printf("  Hardware counters per 1000 numbers (fastest pass):\n");
+
+      for ( int n = 0; n < PERF_EVENTS; ++n ) {
+        const double value = res.counters[n][best];
+        if ( value < 0 )
+          printf("    %-22s n/a\n", perf_event_names[n]);
+        else
+          printf("    %-22s %.3f\n", perf_event_names[n],
+              1000 * value / res.its);
+      }
+
+      const double instructions = res.counters[PERF_INSTRUCTIONS][best];
+      const double cycles = res.counters[PERF_CYCLES][best];
+      if ( instructions >= 0 && cycles > 0 )
+        printf("    %-22s %.3f\n", "IPC", instructions / cycles);
+    }
+
+    if ( res.refill_median > 0 ) {
+      printf("  %.0f — %.0f TSC cycles/refill (min — median, %.0f cycles of "
+             "timing overhead removed)\n", res.refill_min, res.refill_median,
+             res.refill_overhead);
+    }
+
     std::vector<double> persec;
     for ( auto secs : res.times ) {
       persec.push_back(res.its / secs);
@@ -265,7 +668,72 @@ static void report(const Benchmark& res)
            stddev(persec));
 }
 
-static void run_benchmark(const int passes)
+/*
+ * Time single draws with the TSC.  The first draw after seeding, and every
+ * SIZE-th one after that, runs the whole refill, so timing exactly those
+ * gives the cost of generate_numbers() plus one draw.  The cost of a plain
+ * draw, measured the same way, is subtracted to remove the timing overhead.
+ */
+template<class SEEDFUNC, class RANDFUNC>
+static void measure_refill_cycles(Benchmark& result, SEEDFUNC set_seed,
+    RANDFUNC draw_u32, const size_t blocks = 20000)
+{
+  static const size_t SIZE = 624;
+
+  if ( tsc_hz <= 0 )
+    return;
+
+  std::vector<double> refill, plain;
+  refill.reserve(blocks);
+  plain.reserve(blocks);
+
+  set_seed(1);
+
+  for ( size_t b = 0; b < blocks; ++b ) {
+    uint64_t t = tsc_begin();
+    draw_u32();
+    refill.push_back(tsc_end() - t);
+
+    t = tsc_begin();
+    draw_u32();
+    plain.push_back(tsc_end() - t);
+
+    for ( size_t n = 2; n < SIZE; ++n )
+      draw_u32();
+  }
+
+  std::sort(refill.begin(), refill.end());
+  std::sort(plain.begin(), plain.end());
+
+  result.refill_overhead = plain[plain.size()/2];
+  result.refill_min = refill[0] - result.refill_overhead;
+  result.refill_median = refill[refill.size()/2] - result.refill_overhead;
+}
+
+static std::mt19937 std_mt19937;
+static std::mt19937_64 std_mt19937_64;
+
+static const char* stdlib_name()
+{
+#if defined(_LIBCPP_VERSION)
+  return "libc++";
+#elif defined(__GLIBCXX__)
+  return "libstdc++";
+#else
+  return "C++ library";
+#endif
+}
+
+// Every benchmark run, for the machine-readable output
+static std::vector<Benchmark> results;
+static mt::MTIncremental incremental_state;
+
+/*
+ * Time every generator in the -O0 loop and, with optimized_loops, also in an
+ * optimized loop, along with the inline rand_u32_fast() and MTIncremental.
+ * That more than doubles the running time, so it takes --optimized.
+ */
+static void run_benchmark(const int passes, const bool optimized_loops)
 {
   Benchmark ref, our;
 
@@ -274,7 +742,45 @@ static void run_benchmark(const int passes)
         passes);
     fflush(stdout);
     our = benchmark_hashes(mt::seed, mt::rand_u32, passes);
+    our.kernel = "mersenne-twister";
+    measure_refill_cycles(our, mt::seed, mt::rand_u32);
     report(our);
+    results.push_back(our);
+  }
+
+  if ( optimized_loops ) {
+    printf("\nTiming our implementation in an optimized loop ... ");
+    fflush(stdout);
+    Benchmark res = benchmark_optimized(mt::seed, mt::rand_u32, passes);
+    res.kernel = "mersenne-twister (optimized loop)";
+    report(res);
+    results.push_back(res);
+  }
+
+  Benchmark fast;
+
+  if ( optimized_loops ) {
+    printf("\nTiming our inline rand_u32_fast() in an optimized loop ... ");
+    fflush(stdout);
+    fast = benchmark_optimized(mt::seed, []() { return mt::rand_u32_fast(); },
+        passes);
+    fast.kernel = "mersenne-twister inline (optimized loop)";
+    report(fast);
+    results.push_back(fast);
+  }
+
+  Benchmark incremental;
+
+  if ( optimized_loops ) {
+    printf("\nTiming an inline MTIncremental in an optimized loop ... ");
+    fflush(stdout);
+    incremental = benchmark_optimized(
+        [](uint32_t s) { mt::incremental_seed(&incremental_state, s); },
+        []() { return mt::incremental_rand_u32(&incremental_state); },
+        passes);
+    incremental.kernel = "mersenne-twister incremental (optimized loop)";
+    report(incremental);
+    results.push_back(incremental);
   }
 
   {
@@ -284,62 +790,2346 @@ static void run_benchmark(const int passes)
 
     ref = benchmark_hashes(reference::init_genrand, reference::genrand_int32,
         passes);
+    ref.kernel = "mt19937ar";
+    measure_refill_cycles(ref, reference::init_genrand,
+        reference::genrand_int32);
     report(ref);
+    results.push_back(ref);
+  }
+
+  if ( optimized_loops ) {
+    printf("\nTiming reference mt19937ar.c in an optimized loop ... ");
+    fflush(stdout);
+    Benchmark res = benchmark_optimized(reference::init_genrand,
+        reference::genrand_int32, passes);
+    res.kernel = "mt19937ar (optimized loop)";
+    report(res);
+    results.push_back(res);
+  }
+
+  Benchmark std32, std64;
+
+  // The std:: engines are only there for comparison, a few passes will do
+  const int std_passes = std::min(passes, 5);
+
+  {
+    printf("\nTiming %s std::mt19937 (best times over %d passes) ... ",
+        stdlib_name(), std_passes);
+    fflush(stdout);
+
+    std32 = benchmark_hashes(
+        [](uint32_t s) { std_mt19937.seed(s); },
+        []() { return uint32_t(std_mt19937()); },
+        std_passes);
+    std32.kernel = "std::mt19937";
+    measure_refill_cycles(std32,
+        [](uint32_t s) { std_mt19937.seed(s); },
+        []() { return uint32_t(std_mt19937()); });
+    report(std32);
+    results.push_back(std32);
+  }
+
+  if ( optimized_loops ) {
+    printf("\nTiming %s std::mt19937 in an optimized loop ... ",
+        stdlib_name());
+    fflush(stdout);
+    Benchmark res = benchmark_optimized(
+        [](uint32_t s) { std_mt19937.seed(s); },
+        []() { return uint32_t(std_mt19937()); },
+        std_passes);
+    res.kernel = "std::mt19937 (optimized loop)";
+    report(res);
+    results.push_back(res);
+  }
+
+  {
+    printf("\nTiming %s std::mt19937_64, 64 bits per number (best times "
+           "over %d passes) ... ", stdlib_name(), std_passes);
+    fflush(stdout);
+
+    std64 = benchmark_hashes(
+        [](uint32_t s) { std_mt19937_64.seed(s); },
+        []() { return uint32_t(std_mt19937_64()); },
+        std_passes);
+    std64.kernel = "std::mt19937_64";
+    report(std64);
+    results.push_back(std64);
+  }
+
+  if ( optimized_loops ) {
+    printf("\nTiming %s std::mt19937_64 in an optimized loop ... ",
+        stdlib_name());
+    fflush(stdout);
+    Benchmark res = benchmark_optimized(
+        [](uint32_t s) { std_mt19937_64.seed(s); },
+        []() { return uint32_t(std_mt19937_64()); },
+        std_passes);
+    res.kernel = "std::mt19937_64 (optimized loop)";
+    report(res);
+    results.push_back(res);
   }
 
   const double ratio = ref.best / our.best;
   printf("\n%g times %s than the reference (ratio of best runs)\n", ratio,
       ratio > 1 ? "faster" : "slower");
 
+  const double std_ratio = std32.best / our.best;
+  printf("%g times %s than std::mt19937 (ratio of best runs)\n", std_ratio,
+      std_ratio > 1 ? "faster" : "slower");
+
   if ( our.hash != ref.hash ) {
     printf("Error: Our implementation produces incorrect numbers!\n");
   }
-}
 
-int main(int argc, char** argv)
-{
-  printf("Testing Mersenne Twister with reference implementation\n");
-
-  int benchmark_passes = 15;
+  // Pass n uses the same seed everywhere, so compare over the std passes
+  uint32_t ref_hash = 0xffffffff;
+  for ( int n = 0; n < std_passes; ++n )
+    ref_hash ^= ref.hashes[n];
 
-  if ( argc > 1 ) {
-    benchmark_passes = atoi(argv[1]);
+  if ( std32.hash != ref_hash ) {
+    printf("Error: std::mt19937 differs from the reference!\n");
   }
 
-  const int passes = 2;
-  const uint32_t seeds  = 5000;
-  const uint32_t start  = 0;
-  const uint32_t stop   = 5000;
+  if ( !optimized_loops )
+    return;
 
-  for ( int pass=0; pass < passes; ++pass) {
-    for ( uint32_t seed = 0; seed < seeds; ++seed ) {
-      mt::seed(seed);
-      reference::init_genrand(seed);
+  /*
+   * The -O0 loops above call every generator the same way, which makes for a
+   * fair comparison of the generators themselves.  The optimized loops show
+   * what a caller compiled with optimizations actually gets, where the
+   * std:: engines are inlined and ours is a call into another object file.
+   */
+  printf("\nNanoseconds per number, -O0 loop vs optimized loop "
+         "(best runs)\n\n");
+  printf("  %-18s %8s %8s %8s\n", "", "-O0", "optimized", "speedup");
 
-      if ( (seed % 100) == 0 ) {
-        printf("\r  * Pass %d/%d %4" PRIu64 "%%", 1 + pass, passes,
-            100UL * uint64_t(seed)/uint64_t(seeds));
-        fflush(stdout);
-      }
+  for ( size_t n = 0; n < results.size(); ++n ) {
+    const Benchmark& plain = results[n];
 
-      for ( uint32_t n = start; n < stop; ++n ) {
-        uint32_t a = mt::rand_u32();
-        uint32_t b = reference::genrand_int32();
-
-        if ( a != b ) {
-          printf("\r  * Pass %d/%d ERROR\n", 1 + pass, passes);
-          printf("\r    seed=%" PRIu32
-                         " n=%" PRIu32
-                  " expected %" PRIu32
-                  " got %" PRIu32 "\n", seed, n, b, a);
-          return 1;
-        }
-      }
+    for ( size_t m = 0; m < results.size(); ++m ) {
+      const Benchmark& optimized = results[m];
+
+      if ( optimized.kernel != plain.kernel + " (optimized loop)" )
+        continue;
+
+      printf("  %-18s %8.3f %8.3f %7.2fx\n", plain.kernel.c_str(),
+          1e9 * plain.best / plain.its,
+          1e9 * optimized.best / optimized.its, plain.best / optimized.best);
+
+      if ( optimized.hash != plain.hash )
+        printf("Error: %s differs in the optimized loop!\n",
+            plain.kernel.c_str());
     }
+  }
+
+  printf("\n  The inline rand_u32_fast() takes %.3f ns per number in the "
+         "optimized loop\n", 1e9 * fast.best / fast.its);
+
+  printf("  An inline MTIncremental takes %.3f ns per number in the "
+         "optimized loop\n\n", 1e9 * incremental.best / incremental.its);
+
+  if ( incremental.hash != ref.hash ) {
+    printf("Error: MTIncremental produces incorrect numbers!\n");
+  }
 
-    printf("\r  * Pass %d/%d  OK       \n", 1 + pass, passes);
+  if ( fast.hash != ref.hash ) {
+    printf("Error: rand_u32_fast() produces incorrect numbers!\n");
   }
+}
+
+#ifndef BUILD_CXXFLAGS
+# define BUILD_CXXFLAGS "unknown"
+#endif
+
+static const char* compiler()
+{
+#if defined(__clang__)
+  return "clang " __clang_version__;
+#elif defined(__GNUC__)
+  return "gcc " __VERSION__;
+#else
+  return "unknown";
+#endif
+}
+
+static std::string cpu_model()
+{
+  std::string model = "unknown";
+  FILE* f = fopen("/proc/cpuinfo", "r");
+
+  if ( f != NULL ) {
+    char line[512];
+
+    while ( fgets(line, sizeof(line), f) != NULL ) {
+      const char* colon = strchr(line, ':');
+
+      if ( !strncmp(line, "model name", 10) && colon != NULL ) {
+        model = colon + 2;
+        model.erase(model.find_last_not_of("\r\n") + 1);
+        break;
+      }
+    }
+
+    fclose(f);
+  }
+
+  return model;
+}
+
+// Quote a string for CSV or JSON output
+static std::string quoted(const std::string& in, const bool json)
+{
+  std::string out = "\"";
+
+  for ( size_t n = 0; n < in.size(); ++n ) {
+    if ( in[n] == '"' )
+      out += json? "\\\"" : "\"\"";
+    else if ( in[n] == '\\' && json )
+      out += "\\\\";
+    else
+      out += in[n];
+  }
+
+  return out + "\"";
+}
+
+static const char* CSV_HEADER =
+  "kernel,pass,seconds,numbers,numbers_per_second,"
+  "mean_numbers_per_second,stddev_numbers_per_second,"
+  "compiler,flags,cpu,timer,twist_kernel";
+
+static bool write_csv(const char* filename)
+{
+  FILE* f = fopen(filename, "w");
+  if ( f == NULL ) {
+    perror(filename);
+    return false;
+  }
+
+  const std::string meta = quoted(compiler(), false) + "," +
+    quoted(BUILD_CXXFLAGS, false) + "," + quoted(cpu_model(), false) + "," +
+    quoted(timer_name(), false) + "," + quoted(mt::kernel_current(), false);
+
+  fprintf(f, "%s\n", CSV_HEADER);
+
+  for ( size_t b = 0; b < results.size(); ++b ) {
+    const Benchmark& res = results[b];
+
+    std::vector<double> persec;
+    for ( auto secs : res.times )
+      persec.push_back(res.its / secs);
+
+    for ( size_t n = 0; n < res.times.size(); ++n ) {
+      fprintf(f, "%s,%zu,%.9g,%zu,%.9g,%.9g,%.9g,%s\n",
+          quoted(res.kernel, false).c_str(), n, res.times[n], res.its,
+          persec[n], mean(persec), stddev(persec), meta.c_str());
+    }
+  }
+
+  fclose(f);
+  return true;
+}
+
+static void json_array(FILE* f, const std::vector<double>& v)
+{
+  fprintf(f, "[");
+  for ( size_t n = 0; n < v.size(); ++n )
+    fprintf(f, "%s%.9g", n? ", " : "", v[n]);
+  fprintf(f, "]");
+}
+
+static bool write_json(const char* filename)
+{
+  FILE* f = fopen(filename, "w");
+  if ( f == NULL ) {
+    perror(filename);
+    return false;
+  }
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"compiler\": %s,\n", quoted(compiler(), true).c_str());
+  fprintf(f, "  \"flags\": %s,\n", quoted(BUILD_CXXFLAGS, true).c_str());
+  fprintf(f, "  \"cpu\": %s,\n", quoted(cpu_model(), true).c_str());
+  fprintf(f, "  \"timer\": %s,\n", quoted(timer_name(), true).c_str());
+  fprintf(f, "  \"twist_kernel\": %s,\n",
+      quoted(mt::kernel_current(), true).c_str());
+  fprintf(f, "  \"tsc_hz\": %.9g,\n", tsc_hz);
+  fprintf(f, "  \"benchmarks\": [");
+
+  for ( size_t b = 0; b < results.size(); ++b ) {
+    const Benchmark& res = results[b];
+
+    std::vector<double> persec;
+    for ( auto secs : res.times )
+      persec.push_back(res.its / secs);
+
+    fprintf(f, "%s\n    {\n", b? "," : "");
+    fprintf(f, "      \"kernel\": %s,\n", quoted(res.kernel, true).c_str());
+    fprintf(f, "      \"numbers\": %zu,\n", res.its);
+    fprintf(f, "      \"hash\": %" PRIu32 ",\n", res.hash);
+    fprintf(f, "      \"seconds\": ");
+    json_array(f, res.times);
+    fprintf(f, ",\n      \"numbers_per_second\": ");
+    json_array(f, persec);
+    fprintf(f, ",\n");
+    fprintf(f, "      \"min_seconds\": %.9g,\n", min(res.times));
+    fprintf(f, "      \"max_seconds\": %.9g,\n", max(res.times));
+    fprintf(f, "      \"mean_seconds\": %.9g,\n", mean(res.times));
+    fprintf(f, "      \"stddev_seconds\": %.9g,\n", stddev(res.times));
+    fprintf(f, "      \"mean_numbers_per_second\": %.9g,\n", mean(persec));
+    fprintf(f, "      \"stddev_numbers_per_second\": %.9g", stddev(persec));
+
+    if ( tsc_hz > 0 ) {
+      fprintf(f, ",\n      \"cycles_per_number\": %.9g",
+          min(res.times) * tsc_hz / res.its);
+    }
+
+    if ( res.refill_median > 0 ) {
+      fprintf(f, ",\n      \"cycles_per_refill\": %.9g",
+          res.refill_median);
+    }
+
+    for ( int n = 0; n < PERF_EVENTS && !res.counters[n].empty(); ++n ) {
+      std::string name = perf_event_names[n];
+      std::replace(name.begin(), name.end(), ' ', '_');
+      fprintf(f, ",\n      %s: ", quoted(name, true).c_str());
+      json_array(f, res.counters[n]);
+    }
+
+    fprintf(f, "\n    }");
+  }
+
+  fprintf(f, "\n  ]\n}\n");
+  fclose(f);
+  return true;
+}
+
+// Split one line of CSV into fields, honouring double quotes
+static std::vector<std::string> split_csv(const char* line)
+{
+  std::vector<std::string> fields(1);
+  bool quote = false;
+
+  for ( const char* p = line; *p != '\0' && *p != '\n' && *p != '\r'; ++p ) {
+    if ( quote && p[0] == '"' && p[1] == '"' ) {
+      fields.back() += '"';
+      ++p;
+    } else if ( *p == '"' ) {
+      quote = !quote;
+    } else if ( *p == ',' && !quote ) {
+      fields.push_back("");
+    } else {
+      fields.back() += *p;
+    }
+  }
+
+  return fields;
+}
+
+/*
+ * Regularized incomplete beta function I_x(a, b), using the continued
+ * fraction from Numerical Recipes.  Only needed for the t distribution.
+ */
+static double incomplete_beta(double a, double b, double x)
+{
+  if ( x <= 0 ) return 0;
+  if ( x >= 1 ) return 1;
+
+  if ( x > (a + 1) / (a + b + 2) )
+    return 1 - incomplete_beta(b, a, 1 - x);
+
+  const double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) +
+      a*log(x) + b*log(1 - x)) / a;
+
+  double c = 1, d = 1 - (a + b) * x / (a + 1);
+  d = fabs(d) < 1e-300? 1e300 : 1/d;
+  double h = d;
+
+  for ( int m = 1; m < 300; ++m ) {
+    for ( int odd = 0; odd < 2; ++odd ) {
+      const double num = odd?
+        -(a + m) * (a + b + m) * x / ((a + 2*m) * (a + 2*m + 1)) :
+        m * (b - m) * x / ((a + 2*m - 1) * (a + 2*m));
+
+      d = 1 + num * d;
+      d = fabs(d) < 1e-300? 1e300 : 1/d;
+      c = 1 + num / c;
+      if ( fabs(c) < 1e-300 ) c = 1e-300;
+      h *= d * c;
+    }
+
+    if ( fabs(d * c - 1) < 1e-12 )
+      break;
+  }
+
+  return front * h;
+}
+
+/*
+ * One-sided Welch t-test: the probability of seeing a mean at least this much
+ * lower than the baseline's if the two really had the same mean.
+ */
+static double welch_p_lower(const std::vector<double>& now,
+                            const std::vector<double>& base)
+{
+  if ( now.size() < 2 || base.size() < 2 )
+    return 1;
+
+  const double vn = stddev(now) * stddev(now) * now.size() / (now.size() - 1);
+  const double vb = stddev(base) * stddev(base) * base.size() /
+    (base.size() - 1);
+  const double sn = vn / now.size();
+  const double sb = vb / base.size();
+
+  if ( sn + sb <= 0 )
+    return mean(now) < mean(base)? 0 : 1;
+
+  const double t = (mean(now) - mean(base)) / sqrt(sn + sb);
+  const double df = (sn + sb) * (sn + sb) /
+    (sn*sn / (now.size() - 1) + sb*sb / (base.size() - 1));
+
+  // P(T <= t) for Student's t with df degrees of freedom
+  const double tail = 0.5 * incomplete_beta(df/2, 0.5, df / (df + t*t));
+  return t < 0? tail : 1 - tail;
+}
+
+/*
+ * Compare throughput with a baseline CSV file written by --csv.  A kernel has
+ * regressed if its mean numbers/second dropped by more than threshold percent
+ * and a Welch t-test says the drop is significant at the 1% level.  Rows
+ * timed with a different twist kernel are not compared.
+ */
+static bool compare_baseline(const char* filename, const double threshold)
+{
+  FILE* f = fopen(filename, "r");
+  if ( f == NULL ) {
+    perror(filename);
+    return false;
+  }
+
+  struct Row {
+    std::string kernel;
+    std::string twist_kernel;
+    double persec;
+  };
+
+  std::vector<Row> rows;
+  char line[4096];
+  std::vector<std::string> header;
+
+  while ( fgets(line, sizeof(line), f) != NULL ) {
+    const std::vector<std::string> fields = split_csv(line);
+
+    if ( header.empty() ) {
+      header = fields;
+      continue;
+    }
+
+    Row row;
+    row.persec = -1;
+
+    for ( size_t n = 0; n < fields.size() && n < header.size(); ++n ) {
+      if ( header[n] == "kernel" )
+        row.kernel = fields[n];
+      else if ( header[n] == "twist_kernel" )
+        row.twist_kernel = fields[n];
+      else if ( header[n] == "numbers_per_second" )
+        row.persec = atof(fields[n].c_str());
+    }
+
+    if ( !row.kernel.empty() && row.persec > 0 )
+      rows.push_back(row);
+  }
+
+  fclose(f);
+
+  printf("\nComparing with baseline %s (threshold %g%%)\n\n", filename,
+      threshold);
+
+  bool ok = true;
+  const std::string twist_kernel = mt::kernel_current();
+
+  for ( size_t b = 0; b < results.size(); ++b ) {
+    const Benchmark& res = results[b];
+    std::vector<double> now, base;
+    std::string other_twist;
+
+    for ( auto secs : res.times )
+      now.push_back(res.its / secs);
+
+    // Baselines from before the twist_kernel column match any kernel
+    for ( size_t n = 0; n < rows.size(); ++n ) {
+      if ( rows[n].kernel != res.kernel )
+        continue;
+
+      if ( rows[n].twist_kernel.empty() ||
+           rows[n].twist_kernel == twist_kernel )
+        base.push_back(rows[n].persec);
+      else
+        other_twist = rows[n].twist_kernel;
+    }
+
+    if ( base.empty() && !other_twist.empty() ) {
+      printf("  %-24s baseline used twist kernel %s, not %s\n",
+          res.kernel.c_str(), other_twist.c_str(), twist_kernel.c_str());
+      continue;
+    }
+
+    if ( base.empty() ) {
+      printf("  %-24s not in baseline\n", res.kernel.c_str());
+      continue;
+    }
+
+    const double change = 100 * (mean(now) / mean(base) - 1);
+    const double p = welch_p_lower(now, base);
+    const bool regressed = change < -threshold && p < 0.01;
+
+    printf("  %-24s %+7.2f%% (p=%.3g) %s\n", res.kernel.c_str(), change, p,
+        regressed? "REGRESSION" : "OK");
+
+    ok = ok && !regressed;
+  }
+
+  return ok;
+}
+
+// Returns false if the calling thread could not be pinned
+static bool pin_to_cpu(const unsigned cpu)
+{
+#ifdef __linux__
+  const unsigned cpus = std::thread::hardware_concurrency();
+  if ( cpus == 0 )
+    return false;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % cpus, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+/*
+ * Run 1 ... max_threads threads at once, each drawing from its own MTState
+ * that it allocates and seeds itself, so the state lives where the thread
+ * first touches it.  With pinning, thread n runs on CPU n; on most Linux
+ * systems the SMT siblings are numbered after all the physical cores.
+ *
+ * Threads are timed with CLOCK_MONOTONIC_RAW, since getrusage would add up
+ * the time of all threads.
+ */
+static void run_thread_benchmark(const unsigned max_threads, const bool pin,
+    const size_t its = 100000000)
+{
+  printf("\nScaling over threads with one generator each (%s, %s numbers "
+         "per thread)\n\n", pin? "pinned" : "not pinned", sscale(its, 0));
+  printf("  %7s %14s %14s %14s %10s\n", "threads", "aggregate/s",
+      "per-thread/s", "slowest/s", "efficiency");
+
+  double single = 0;
+  std::atomic<uint32_t> sink(0);
+  std::atomic<bool> unpinned(false);
+
+  for ( unsigned count = 1; count <= max_threads; ++count ) {
+    std::vector<double> secs(count);
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> ready(0);
+    std::atomic<bool> go(false);
+
+    for ( unsigned t = 0; t < count; ++t ) {
+      threads.push_back(std::thread([&, t]() {
+        if ( pin && !pin_to_cpu(t) )
+          unpinned = true;
+
+        mt::MTState* state = new mt::MTState;
+        mt::seed_r(state, t);
+        uint32_t hash = 0;
+
+        ++ready;
+        while ( !go )
+          ;
+
+        const double start = monotonic_raw_secs();
+        for ( size_t n = 0; n < its; ++n )
+          hash ^= mt::rand_u32_r(state);
+        secs[t] = monotonic_raw_secs() - start;
+
+        sink ^= hash;
+        delete state;
+      }));
+    }
+
+    while ( ready < count )
+      ;
+    go = true;
+
+    for ( unsigned t = 0; t < count; ++t )
+      threads[t].join();
+
+    const double aggregate = count * its / max(secs);
+    const double per_thread = its / mean(secs);
+
+    if ( count == 1 )
+      single = aggregate;
+
+    printf("  %7u %14s", count, sscale(aggregate));
+    printf(" %14s", sscale(per_thread));
+    printf(" %14s %9.1f%%\n", sscale(its / max(secs)),
+        100 * aggregate / (count * single));
+  }
+
+  if ( unpinned )
+    printf("\nWarning: Some threads could not be pinned and ran unpinned\n");
+}
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: values are bucketed by
+ * their power of two, and each power of two is split into 32 linear
+ * sub-buckets, so every recorded value is kept to within about 3%.
+ */
+struct Histogram {
+  static const int SUB_BITS = 5;
+  static const uint64_t SUB_COUNT = 1 << SUB_BITS;
+
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t largest;
+
+  Histogram() : counts(64 * SUB_COUNT), total(0), largest(0)
+  {
+  }
+
+  static size_t bucket(const uint64_t value)
+  {
+    if ( value < SUB_COUNT )
+      return value;
+
+    // value >> shift is in [SUB_COUNT, 2*SUB_COUNT)
+    const int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return shift * SUB_COUNT + (value >> shift);
+  }
+
+  // Largest value that falls in the given bucket
+  static uint64_t highest(const size_t index)
+  {
+    if ( index < 2*SUB_COUNT )
+      return index;
+
+    const int shift = index / SUB_COUNT - 1;
+    const uint64_t sub = index % SUB_COUNT + SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  void add(const uint64_t value)
+  {
+    ++counts[bucket(value)];
+    ++total;
+    largest = value > largest? value : largest;
+  }
+
+  uint64_t percentile(const double p) const
+  {
+    const uint64_t rank = uint64_t(ceil(p / 100 * total));
+    uint64_t seen = 0;
+
+    for ( size_t n = 0; n < counts.size(); ++n ) {
+      seen += counts[n];
+      if ( seen >= rank && seen > 0 )
+        return std::min(highest(n), largest);
+    }
+
+    return largest;
+  }
+};
+
+/*
+ * Time every call, or every batch of calls, of a generator with the TSC (or
+ * CLOCK_MONOTONIC_RAW in nanoseconds without one).  The mean hides the
+ * refill that every 624th number pays for, but the tail percentiles don't.
+ */
+static volatile uint32_t latency_sink;
+
+template<class SEEDFUNC, class RANDFUNC>
+static void report_latency(const char* name, SEEDFUNC set_seed,
+    RANDFUNC draw_u32, const size_t batch, const size_t samples = 10000000)
+{
+  Histogram hist;
+  uint32_t hash = 0;
+
+  set_seed(3);
+
+  for ( size_t n = 0; n < samples; ++n ) {
+    if ( tsc_hz > 0 ) {
+      const uint64_t start = tsc_begin();
+      for ( size_t k = 0; k < batch; ++k )
+        hash ^= draw_u32();
+      hist.add(tsc_end() - start);
+    } else {
+      const double start = monotonic_raw_secs();
+      for ( size_t k = 0; k < batch; ++k )
+        hash ^= draw_u32();
+      hist.add(uint64_t(1e9 * (monotonic_raw_secs() - start)));
+    }
+  }
+
+  printf("  %-20s %7" PRIu64 " %7" PRIu64 " %7" PRIu64 " %7" PRIu64
+      " %7" PRIu64 " %9" PRIu64 "\n", name,
+      hist.percentile(50), hist.percentile(90), hist.percentile(99),
+      hist.percentile(99.9), hist.percentile(99.99), hist.largest);
+
+  latency_sink = hash;
+}
+
+static void run_latency_benchmark(const size_t batch)
+{
+  printf("\nLatency per %zu call%s in %s, including timing overhead\n\n",
+      batch, batch > 1? "s" : "", tsc_hz > 0? "TSC cycles" : "nanoseconds");
+  printf("  %-20s %7s %7s %7s %7s %7s %9s\n", "", "p50", "p90", "p99",
+      "p99.9", "p99.99", "max");
+
+  report_latency("timing overhead", mt::seed, [](){ return 0u; }, batch);
+  report_latency("mersenne-twister", mt::seed, mt::rand_u32, batch);
+  report_latency("rand_u32_fast", mt::seed,
+      [](){ return mt::rand_u32_fast(); }, batch);
+  report_latency("incremental",
+      [](uint32_t s){ mt::incremental_seed(&incremental_state, s); },
+      [](){ return mt::incremental_rand_u32(&incremental_state); }, batch);
+  report_latency("mt19937ar", reference::init_genrand,
+      reference::genrand_int32, batch);
+}
+
+/*
+ * The C++ standard requires the 10000th number from a default-constructed
+ * std::mt19937 to be 4123659995, and from std::mt19937_64 to be
+ * 9981545732273789042.  The default seed is 5489, so that gives a cross-check
+ * of all three engines.
+ */
+static bool check_std_engines()
+{
+  std::mt19937 engine32;
+  std::mt19937_64 engine64;
+
+  mt::seed(5489);
+
+  uint32_t ours = 0, theirs = 0;
+  uint64_t theirs64 = 0;
+
+  for ( int n = 0; n < 10000; ++n ) {
+    ours = mt::rand_u32();
+    theirs = engine32();
+    theirs64 = engine64();
+  }
+
+  printf("  * Standard engines %" PRIu32 " %" PRIu32 " %" PRIu64, ours,
+      theirs, theirs64);
+
+  if ( ours != 4123659995u || theirs != 4123659995u ||
+       theirs64 != 9981545732273789042ull )
+  {
+    printf(" ERROR\n");
+    return false;
+  }
+
+  printf(" OK\n");
+  return true;
+}
+
+/*
+ * Check every twist kernel against the reference, for seeds 0 ... seeds-1 and
+ * the first `numbers` numbers of each.  The seeds are handed out in chunks to
+ * one thread per core, each with its own MTState and its own reentrant
+ * reference state, so this scales to millions of seeds.
+ */
+static bool verify_parallel(const uint32_t seeds, const uint32_t numbers)
+{
+  static const uint32_t CHUNK = 16;
+
+  const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  const char* initial = mt::kernel_current();
+  bool ok = true;
+
+  for ( size_t k = 0; k < mt::kernel_count() && ok; ++k ) {
+    const char* name = mt::kernel_name(k);
+    mt::kernel_select(name);
+
+    std::atomic<uint64_t> next(0);
+    std::atomic<bool> failed(false);
+    uint32_t bad_seed = 0, bad_n = 0, expected = 0, got = 0;
+    std::mutex error;
+
+    auto worker = [&]() {
+      mt::MTState ours;
+      reference::genrand_state theirs;
+
+      for ( ;; ) {
+        const uint64_t first = next.fetch_add(CHUNK);
+        if ( first >= seeds || failed )
+          return;
+
+        const uint64_t last = std::min<uint64_t>(first + CHUNK, seeds);
+
+        for ( uint64_t seed = first; seed < last; ++seed ) {
+          mt::seed_r(&ours, seed);
+          reference::init_genrand_r(&theirs, seed);
+
+          for ( uint32_t n = 0; n < numbers; ++n ) {
+            const uint32_t a = mt::rand_u32_r(&ours);
+            const uint32_t b = reference::genrand_int32_r(&theirs);
+
+            if ( a != b ) {
+              std::lock_guard<std::mutex> lock(error);
+              if ( !failed ) {
+                bad_seed = seed;
+                bad_n = n;
+                expected = b;
+                got = a;
+                failed = true;
+              }
+              return;
+            }
+          }
+        }
+      }
+    };
+
+    Timer timer;
+
+    std::vector<std::thread> pool;
+    for ( unsigned t = 1; t < threads; ++t )
+      pool.push_back(std::thread(worker));
+    worker();
+    for ( auto& t : pool )
+      t.join();
+
+    if ( failed ) {
+      printf("  * Kernel %s ERROR\n", name);
+      printf("    seed=%" PRIu32
+                 " n=%" PRIu32
+          " expected %" PRIu32
+          " got %" PRIu32 "\n", bad_seed, bad_n, expected, got);
+      ok = false;
+    } else {
+      printf("  * Kernel %-12s %" PRIu32 " seeds x %" PRIu32 " numbers on "
+          "%u thread%s OK (%.2fs)\n", name, seeds, numbers, threads,
+          threads > 1? "s" : "", timer.elapsed_secs());
+    }
+  }
+
+  mt::kernel_select(initial);
+  return ok;
+}
+
+/*
+ * Time each twist kernel through rand_u32, print a table and write the
+ * fastest one to a makefile fragment that the Makefile includes, so the next
+ * build starts out with it.
+ */
+static bool run_tune(const char* file)
+{
+  const uint64_t count = 100000000;
+
+  printf("\nTuning twist kernels (per number, best of 5)\n\n");
+  printf("  %-12s %10s %10s %10s\n", "kernel", "ns", "TSC cycles",
+      "speedup");
+
+  const char* initial = mt::kernel_current();
+  std::vector<double> secs(mt::kernel_count(), DBL_MAX);
+
+  for ( size_t k = 0; k < mt::kernel_count(); ++k ) {
+    mt::kernel_select(mt::kernel_name(k));
+
+    for ( int pass = 0; pass < 5; ++pass ) {
+      mt::seed(pass);
+      uint32_t sum = 0;
+
+      Timer timer;
+      for ( uint64_t n = 0; n < count; ++n )
+        sum += mt::rand_u32();
+      secs[k] = std::min(secs[k], timer.elapsed_secs());
+
+      // Keep the loop from being optimized away
+      if ( sum == 0x12345678 )
+        printf(" ");
+    }
+  }
+
+  size_t best = 0;
+  for ( size_t k = 0; k < secs.size(); ++k ) {
+    if ( secs[k] < secs[best] )
+      best = k;
+  }
+
+  for ( size_t k = 0; k < secs.size(); ++k ) {
+    printf("  %-12s %10.3f %10.3f %9.2fx%s\n", mt::kernel_name(k),
+        1e9 * secs[k] / count, secs[k] * tsc_hz / count, secs[0] / secs[k],
+        k == best? "  <- fastest" : "");
+  }
+
+  printf("\nkernel_tune() picks %s; the default was %s\n",
+      mt::kernel_tune(), initial);
+  mt::kernel_select(initial);
+
+  FILE* f = fopen(file, "w");
+  if ( f == NULL ) {
+    perror(file);
+    return false;
+  }
+
+  fprintf(f, "# Written by ./test-mt --tune on %s\n", cpu_model().c_str());
+  fprintf(f, "CPPFLAGS += -DMT_KERNEL='\"%s\"'\n", mt::kernel_name(best));
+  fclose(f);
+
+  printf("Wrote %s, rebuild to make %s the default\n", file,
+      mt::kernel_name(best));
+  return true;
+}
+
+/*
+ * Compare rand_normal_array against an exact double-precision Box-Muller
+ * transform of the same words, and check the first two moments.
+ */
+static bool check_normals()
+{
+  const size_t count = 1000000;
+  std::vector<float> normals(count);
+
+  // Start at an odd position so groups straddle block boundaries
+  mt::seed(1234);
+  mt::rand_u32();
+  mt::rand_normal_array(&normals[0], count);
+  const uint32_t next = mt::rand_u32();
+
+  mt::seed(1234);
+  mt::rand_u32();
+
+  double max_error = 0, sum = 0, sumsq = 0;
+
+  for ( size_t n = 0; n < count; n += 16 ) {
+    uint32_t w[16];
+    for ( size_t k = 0; k < 16; ++k )
+      w[k] = mt::rand_u32();
+
+    for ( size_t k = 0; k < 8; ++k ) {
+      const double u = w[k] < (1u << 24)? (w[k] + 1) / 4294967296.0 :
+        ((w[k] >> 8) + 1) / 16777216.0;
+      const double v = (w[k+8] >> 8) / 16777216.0;
+      const double r = sqrt(-2.0 * log(u));
+      const double z[2] = { r * cos(2*M_PI*v), r * sin(2*M_PI*v) };
+
+      for ( size_t j = 0; j < 2; ++j ) {
+        const double got = normals[n + k + 8*j];
+        max_error = fmax(max_error, fabs(got - z[j]));
+        sum += got;
+        sumsq += got*got;
+      }
+    }
+  }
+
+  const double m = sum/count;
+  const double var = sumsq/count - m*m;
+
+  printf("  * Normals max error=%g mean=%g variance=%g", max_error, m, var);
+
+  if ( max_error > 2e-6 || fabs(m) > 0.01 || fabs(var - 1) > 0.01 ) {
+    printf(" ERROR\n");
+    return false;
+  }
+
+  if ( next != mt::rand_u32() ) {
+    printf(" ERROR (consumed wrong number of words)\n");
+    return false;
+  }
+
+  printf(" OK\n");
+  return true;
+}
+
+/*
+ * The batched shuffle must give the same permutation as the textbook one, and
+ * all permutations of a small array must be about equally likely.
+ */
+static bool check_shuffle()
+{
+  std::vector<uint32_t> a(100000), b(100000);
+
+  for ( size_t n = 0; n < a.size(); ++n )
+    a[n] = b[n] = n;
+
+  mt::seed(42);
+  mt::rand_shuffle_u32(&a[0], a.size());
+
+  mt::seed(42);
+  for ( size_t n = b.size() - 1; n > 0; --n )
+    std::swap(b[n], b[mt::rand_below(n + 1)]);
+
+  if ( a != b ) {
+    printf("  * Shuffle ERROR (differs from plain Fisher-Yates)\n");
+    return false;
+  }
+
+  const size_t trials = 600000;
+  size_t counts[6] = {0};
+
+  for ( size_t n = 0; n < trials; ++n ) {
+    uint32_t p[3] = {0, 1, 2};
+    mt::rand_shuffle_u32(p, 3);
+    // Lehmer code of the permutation
+    ++counts[2*p[0] + (p[1] > p[2])];
+  }
+
+  double chi2 = 0;
+  for ( size_t n = 0; n < 6; ++n ) {
+    const double expected = trials / 6.0;
+    chi2 += (counts[n] - expected) * (counts[n] - expected) / expected;
+  }
+
+  // 5 degrees of freedom, p = 0.001
+  printf("  * Shuffle chi2=%g", chi2);
+
+  if ( chi2 > 20.5 ) {
+    printf(" ERROR\n");
+    return false;
+  }
+
+  printf(" OK\n");
+  return true;
+}
+
+static double chi_squared(const std::vector<size_t>& counts, double expected)
+{
+  double chi2 = 0;
+  for ( size_t n = 0; n < counts.size(); ++n )
+    chi2 += (counts[n] - expected) * (counts[n] - expected) / expected;
+  return chi2;
+}
+
+/*
+ * Every item must be equally likely to be sampled, both by rand_sample and by
+ * reservoir sampling.
+ */
+static bool check_sampling()
+{
+  const uint64_t n = 1000;
+  const size_t k = 20;
+  const size_t trials = 100000;
+
+  // With n-1 degrees of freedom, mean n-1 and stddev sqrt(2(n-1)) ~ 44.7
+  const double limit = (n - 1) + 5*sqrt(2.0*(n - 1));
+
+  std::vector<size_t> counts(n);
+  std::vector<uint64_t> sample(k);
+
+  mt::seed(7);
+
+  for ( size_t t = 0; t < trials; ++t ) {
+    mt::rand_sample(&sample[0], k, n);
+
+    for ( size_t i = 0; i < k; ++i ) {
+      if ( sample[i] >= n || (i > 0 && sample[i] <= sample[i-1]) ) {
+        printf("  * Sampling ERROR (not sorted and in range)\n");
+        return false;
+      }
+      ++counts[sample[i]];
+    }
+  }
+
+  const double chi2_sample = chi_squared(counts, double(trials) * k / n);
+
+  std::fill(counts.begin(), counts.end(), 0);
+
+  for ( size_t t = 0; t < trials; ++t ) {
+    uint64_t reservoir[k];
+    mt::Reservoir r;
+
+    for ( size_t i = 0; i < k; ++i )
+      reservoir[i] = i;
+
+    mt::reservoir_init(&r, k);
+
+    while ( r.next < n ) {
+      const uint64_t item = r.next;
+      reservoir[mt::reservoir_slot(&r)] = item;
+    }
+
+    for ( size_t i = 0; i < k; ++i )
+      ++counts[reservoir[i]];
+  }
+
+  const double chi2_reservoir = chi_squared(counts, double(trials) * k / n);
+
+  printf("  * Sampling chi2=%g reservoir chi2=%g", chi2_sample,
+      chi2_reservoir);
+
+  // Empty samples draw nothing
+  mt::seed(5489);
+  mt::Reservoir empty;
+  mt::reservoir_init(&empty, 0);
+  const bool empty_ok = empty.next == UINT64_MAX &&
+    mt::reservoir_slot(&empty) == 0 && mt::rand_u32() == 3499211612u;
+
+  if ( chi2_sample > limit || chi2_reservoir > limit || !empty_ok ) {
+    printf(" ERROR\n");
+    return false;
+  }
+
+  printf(" OK\n");
+  return true;
+}
+
+/*
+ * Bit masks must have the requested density, in every bit position, and for
+ * p = 1/2 be exactly the generated numbers.
+ */
+static bool check_masks()
+{
+  const size_t words = 1 << 20;
+  std::vector<uint32_t> mask(words);
+
+  mt::seed(99);
+  mt::rand_mask(&mask[0], words, 0.5);
+
+  mt::seed(99);
+  for ( size_t n = 0; n < words; ++n ) {
+    if ( mask[n] != mt::rand_u32() ) {
+      printf("  * Masks ERROR (p=0.5 differs from rand_u32)\n");
+      return false;
+    }
+  }
+
+  const double ps[] = {0.0, 1.0/65536, 0.1, 0.25, 0.3, 0.9, 1.0};
+  double worst = 0;
+
+  for ( size_t i = 0; i < sizeof(ps)/sizeof(ps[0]); ++i ) {
+    const double p = floor(ps[i] * 65536 + 0.5) / 65536;
+    size_t ones[32] = {0};
+
+    mt::rand_mask(&mask[0], words, ps[i]);
+
+    for ( size_t n = 0; n < words; ++n )
+      for ( int bit = 0; bit < 32; ++bit )
+        ones[bit] += (mask[n] >> bit) & 1;
+
+    // Allow 5 standard deviations per bit position
+    const double sd = sqrt(p * (1 - p) / words);
+
+    for ( int bit = 0; bit < 32; ++bit ) {
+      const double error = fabs(double(ones[bit]) / words - p);
+      if ( error > 5*sd + 1e-12 ) {
+        printf("  * Masks ERROR (p=%g bit %d has density %g)\n", ps[i], bit,
+            double(ones[bit]) / words);
+        return false;
+      }
+      worst = fmax(worst, sd > 0? error/sd : 0);
+    }
+  }
+
+  printf("  * Masks worst deviation %.2f sd OK\n", worst);
+  return true;
+}
+
+/*
+ * rand_bytes must give the bytes of the rand_u32() sequence for any
+ * alignment, length and starting position, with and without streaming
+ * stores.
+ */
+static bool check_bytes()
+{
+  const size_t lengths[] = {0, 1, 3, 4, 15, 17, 2495, 2496, 2497, 10007,
+    1 << 20};
+  std::vector<uint8_t> buffer((1 << 20) + 64);
+  std::vector<uint32_t> expected(((1 << 20) + 4) / 4 + 1);
+
+  for ( int stream = 0; stream < 2; ++stream ) {
+    mt::rand_bytes_stream_threshold(stream? 1 : 0);
+
+    for ( size_t i = 0; i < sizeof(lengths)/sizeof(lengths[0]); ++i ) {
+      for ( size_t offset = 0; offset < 16; offset += 5 ) {
+        const size_t len = lengths[i];
+        const size_t skip = (i * 101 + offset) % 700;
+
+        mt::seed(i + offset);
+        for ( size_t n = 0; n < skip; ++n )
+          mt::rand_u32();
+        mt::rand_bytes(&buffer[offset], len);
+        const uint32_t next = mt::rand_u32();
+
+        mt::seed(i + offset);
+        for ( size_t n = 0; n < skip; ++n )
+          mt::rand_u32();
+        for ( size_t n = 0; n < (len + 3)/4; ++n )
+          expected[n] = mt::rand_u32();
+
+        if ( memcmp(&buffer[offset], &expected[0], len) != 0 ||
+             next != mt::rand_u32() )
+        {
+          printf("  * Bytes ERROR (len=%zu offset=%zu stream=%d)\n", len,
+              offset, stream);
+          return false;
+        }
+      }
+    }
+  }
+
+  mt::rand_bytes_stream_threshold(0);
+  printf("  * Bytes OK\n");
+  return true;
+}
+
+/*
+ * rand_u32_array and rand_double_array must give the same numbers as
+ * genrand_int32 and genrand_res53, starting anywhere in a block and for
+ * lengths that do and don't end on a block boundary.
+ */
+static bool check_arrays()
+{
+  const size_t lengths[] = {0, 1, 2, 311, 312, 623, 624, 625, 1000, 5000};
+  const size_t skips[] = {0, 1, 311, 623};
+
+  std::vector<uint32_t> ints(5000);
+  std::vector<double> doubles(5000);
+
+  for ( size_t skip : skips ) {
+    for ( size_t len : lengths ) {
+      mt::seed(len + skip);
+      reference::init_genrand(len + skip);
+
+      for ( size_t n = 0; n < skip; ++n ) {
+        mt::rand_u32();
+        reference::genrand_int32();
+      }
+
+      mt::rand_u32_array(&ints[0], len);
+      mt::rand_double_array(&doubles[0], len);
+
+      bool ok = true;
+      for ( size_t n = 0; n < len; ++n )
+        ok = ok && ints[n] == reference::genrand_int32();
+      for ( size_t n = 0; n < len; ++n )
+        ok = ok && doubles[n] == reference::genrand_res53();
+
+      // Borrowed in place, in as many pieces as the blocks make it
+      const uint32_t* block = mt::mt_global_state.MT_TEMPERED;
+      for ( size_t done = 0; ok && done < len; ) {
+        size_t n = len - done;
+        const uint32_t* p = mt::rand_u32_borrow(&n);
+        ok = n > 0 && n <= len - done && p >= block && p + n <= block + 624;
+
+        for ( size_t k = 0; k < n; ++k )
+          ok = ok && p[k] == reference::genrand_int32();
+        done += n;
+      }
+
+      if ( !ok || mt::rand_u32() != reference::genrand_int32() ) {
+        printf("  * Arrays ERROR (len=%zu skip=%zu)\n", len, skip);
+        return false;
+      }
+    }
+  }
+
+  printf("  * Arrays OK\n");
+  return true;
+}
+
+/*
+ * Time filling a buffer of each size from 64 bytes up to max_bytes, first one
+ * rand_u32() call per word and then with the bulk functions.  Small buffers
+ * are filled many times over so that each measurement covers about the same
+ * amount of data.  The throughput drops where the buffer no longer fits in a
+ * cache level.
+ */
+static void run_sweep_benchmark(const size_t max_bytes)
+{
+  static const size_t WORK = size_t(1) << 28;
+
+  printf("\nFilling buffers (GB/s and TSC cycles per 32-bit word, "
+         "best of 3)\n\n");
+  printf("  %10s  %15s  %15s  %15s  %15s\n", "bytes", "rand_u32 loop",
+      "rand_u32_array", "double_array", "rand_bytes");
+
+  std::vector<uint32_t> buffer(max_bytes / sizeof(uint32_t));
+  uint32_t* words = &buffer[0];
+
+  // Touch every page first so that page faults aren't timed
+  mt::rand_u32_array(words, buffer.size());
+
+  for ( size_t bytes = 64; bytes <= max_bytes; bytes *= 2 ) {
+    const size_t count = bytes / sizeof(uint32_t);
+    const size_t reps = bytes < WORK? WORK / bytes : 1;
+
+    double secs[4] = {DBL_MAX, DBL_MAX, DBL_MAX, DBL_MAX};
+
+    for ( int pass = 0; pass < 3; ++pass ) {
+      mt::seed(pass);
+
+      Timer timer;
+      for ( size_t r = 0; r < reps; ++r ) {
+        for ( size_t n = 0; n < count; ++n )
+          words[n] = mt::rand_u32();
+        do_not_optimize(words[0]);
+      }
+      secs[0] = std::min(secs[0], timer.elapsed_secs());
+
+      timer.reset();
+      for ( size_t r = 0; r < reps; ++r )
+        mt::rand_u32_array(words, count);
+      secs[1] = std::min(secs[1], timer.elapsed_secs());
+
+      timer.reset();
+      for ( size_t r = 0; r < reps; ++r )
+        mt::rand_double_array(reinterpret_cast<double*>(words), count/2);
+      secs[2] = std::min(secs[2], timer.elapsed_secs());
+
+      timer.reset();
+      for ( size_t r = 0; r < reps; ++r )
+        mt::rand_bytes(words, bytes);
+      secs[3] = std::min(secs[3], timer.elapsed_secs());
+    }
+
+    printf("  %10zu", bytes);
+    for ( int k = 0; k < 4; ++k ) {
+      const double total = double(bytes) * reps;
+      printf("  %7.2f %7.3f", total / secs[k] / 1e9,
+          secs[k] * tsc_hz * sizeof(uint32_t) / total);
+    }
+    printf("\n");
+  }
+}
+
+/*
+ * seed_batch_r must leave every state exactly as seed_r does, and restoring a
+ * snapshot with set_state must replay the same numbers.
+ */
+static bool check_seeding()
+{
+  const size_t count = 19;  // Two full batches and a few left over
+  std::vector<mt::MTState> batch(count), single(count);
+  std::vector<uint32_t> values(count);
+
+  for ( size_t n = 0; n < count; ++n ) {
+    values[n] = uint32_t(n * 2654435761u);
+    mt::seed_r(&single[n], values[n]);
+  }
+
+  mt::seed_batch_r(&batch[0], &values[0], count);
+
+  for ( size_t n = 0; n < count; ++n ) {
+    if ( memcmp(batch[n].MT, single[n].MT, sizeof(single[n].MT)) != 0 ||
+         batch[n].index != single[n].index ||
+         mt::rand_u32_r(&batch[n]) != mt::rand_u32_r(&single[n]) )
+    {
+      printf("  * Seeding ERROR (batch state %zu)\n", n);
+      return false;
+    }
+  }
+
+  mt::MTState snapshot;
+  uint32_t first[1000];
+
+  mt::seed(1234);
+  for ( int n = 0; n < 1000; ++n )
+    mt::rand_u32();
+
+  mt::get_state(&snapshot);
+  for ( int n = 0; n < 1000; ++n )
+    first[n] = mt::rand_u32();
+
+  mt::set_state(&snapshot);
+  for ( int n = 0; n < 1000; ++n ) {
+    if ( mt::rand_u32() != first[n] ) {
+      printf("  * Seeding ERROR (snapshot restore)\n");
+      return false;
+    }
+  }
+
+  printf("  * Seeding OK\n");
+  return true;
+}
+
+/*
+ * Time creating short-lived generators: seeds per second, and the time from
+ * starting to have the first number, which also pays for the first refill.
+ * A pool of states that is larger than L1 is cycled through, like a server
+ * would do with one generator per request.
+ */
+static void run_seeding_benchmark()
+{
+  static const size_t STATES = 64;
+  static const size_t ROUNDS = 2000;
+
+  std::vector<mt::MTState> states(STATES);
+  std::vector<uint32_t> values(STATES);
+
+  mt::MTState fresh, ready;
+  mt::seed_r(&fresh, 5489);
+  ready = fresh;
+  mt::rand_u32_r(&ready);
+  ready.index = 0;  // Tempered block already there, rewound to the start
+
+  std::mt19937 engine;
+
+  printf("\nCreating generators (best of 5)\n\n");
+  printf("  %-30s %14s %18s\n", "method", "seeds/second",
+      "ns to 1st number");
+
+  auto time = [&](const char* name, std::function<void(size_t)> create,
+      std::function<uint32_t(size_t)> first)
+  {
+    double seed_secs = DBL_MAX, first_secs = DBL_MAX;
+
+    for ( int pass = 0; pass < 5; ++pass ) {
+      for ( size_t n = 0; n < STATES; ++n )
+        values[n] = uint32_t(pass * STATES + n);
+
+      Timer timer;
+      for ( size_t r = 0; r < ROUNDS; ++r )
+        create(r);
+      seed_secs = std::min(seed_secs, timer.elapsed_secs());
+
+      timer.reset();
+      uint32_t sum = 0;
+      for ( size_t r = 0; r < ROUNDS; ++r ) {
+        create(r);
+        for ( size_t n = 0; n < STATES; ++n )
+          sum += first(n);
+      }
+      do_not_optimize(sum);
+      first_secs = std::min(first_secs, timer.elapsed_secs());
+    }
+
+    const double created = double(ROUNDS) * STATES;
+    printf("  %-30s %14s %18.1f\n", name, sscale(created / seed_secs),
+        1e9 * first_secs / created);
+  };
+
+  time("seed_r",
+    [&](size_t) {
+      for ( size_t n = 0; n < STATES; ++n )
+        mt::seed_r(&states[n], values[n]);
+    },
+    [&](size_t n) { return mt::rand_u32_r(&states[n]); });
+
+  time("seed_batch_r",
+    [&](size_t) { mt::seed_batch_r(&states[0], &values[0], STATES); },
+    [&](size_t n) { return mt::rand_u32_r(&states[n]); });
+
+  time("restore seeded snapshot",
+    [&](size_t) {
+      for ( size_t n = 0; n < STATES; ++n )
+        states[n] = fresh;
+    },
+    [&](size_t n) { return mt::rand_u32_r(&states[n]); });
+
+  time("restore snapshot with block",
+    [&](size_t) {
+      for ( size_t n = 0; n < STATES; ++n )
+        states[n] = ready;
+    },
+    [&](size_t n) { return mt::rand_u32_r(&states[n]); });
+
+  time("std::mt19937::seed",
+    [&](size_t) {
+      for ( size_t n = 0; n < STATES; ++n )
+        engine.seed(values[n]);
+    },
+    [&](size_t) { return uint32_t(engine()); });
+}
+
+/*
+ * MTState doesn't have to start on a cache line.  Draw with every kind of
+ * function from states 8 and 16 bytes off one, as malloc may give them, and
+ * compare with a state on the stack.
+ */
+static bool check_unaligned_state()
+{
+  std::vector<uint8_t> buffer(sizeof(mt::MTState) + 128);
+  uint8_t* line = &buffer[0] + (64 - reinterpret_cast<uintptr_t>(&buffer[0])
+      % 64) % 64;
+
+  std::vector<uint32_t> words(1000), expected_words(1000);
+  std::vector<double> doubles(500), expected_doubles(500);
+  std::vector<float> normals(500), expected_normals(500);
+  bool ok = true;
+
+  for ( size_t offset = 8; offset <= 16 && ok; offset += 8 ) {
+    mt::MTState* s = reinterpret_cast<mt::MTState*>(line + offset);
+    mt::MTState expected;
+
+    mt::seed_r(s, 42);
+    mt::seed_r(&expected, 42);
+
+    ok = mt::rand_u32_r(s) == mt::rand_u32_r(&expected);
+
+    mt::rand_u32_array_r(s, &words[0], words.size());
+    mt::rand_u32_array_r(&expected, &expected_words[0], words.size());
+    mt::rand_double_array_r(s, &doubles[0], doubles.size());
+    mt::rand_double_array_r(&expected, &expected_doubles[0], doubles.size());
+    mt::rand_normal_array_r(s, &normals[0], normals.size());
+    mt::rand_normal_array_r(&expected, &expected_normals[0], normals.size());
+
+    ok = ok && words == expected_words && doubles == expected_doubles &&
+      normals == expected_normals;
+
+    mt::rand_bytes_r(s, &words[0], 999);
+    mt::rand_bytes_r(&expected, &expected_words[0], 999);
+    ok = ok && !memcmp(&words[0], &expected_words[0], 999) &&
+      mt::rand_u32_r(s) == mt::rand_u32_r(&expected);
+  }
+
+  printf("  * Unaligned states %s\n", ok? "OK" : "ERROR");
+  return ok;
+}
+
+// States from state_arena_alloc must be aligned and work like any other
+static bool check_arena()
+{
+  const size_t count = 1000;
+  int huge = 0;
+  mt::MTState* arena = mt::state_arena_alloc(count, &huge);
+
+  if ( arena == NULL || reinterpret_cast<uintptr_t>(arena) % (2 << 20) != 0 ) {
+    printf("  * Arena ERROR (allocation)\n");
+    return false;
+  }
+
+  std::vector<uint32_t> seeds(count);
+  for ( size_t n = 0; n < count; ++n )
+    seeds[n] = n;
+  mt::seed_batch_r(arena, &seeds[0], count);
+
+  mt::MTState single;
+  bool ok = true;
+
+  for ( size_t n = 0; n < count && ok; n += 97 ) {
+    mt::seed_r(&single, n);
+    for ( int k = 0; k < 1000 && ok; ++k )
+      ok = mt::rand_u32_r(&arena[n]) == mt::rand_u32_r(&single);
+  }
+
+  mt::state_arena_free(arena, count);
+
+  printf("  * Arena (%s) %s\n", huge == 2? "MAP_HUGETLB" : huge == 1?
+      "transparent huge pages" : "4 KiB pages", ok? "OK" : "ERROR");
+  return ok;
+}
+
+/*
+ * thread_state() must give each thread its own generator, seeded once, on
+ * the thread's own node.
+ */
+static bool check_thread_state()
+{
+  mt::MTState* mine = mt::thread_state(77);
+  mt::MTState expected;
+  mt::seed_r(&expected, 77);
+
+  bool ok = mine != NULL && mt::thread_state(78) == mine;
+
+  for ( int n = 0; n < 1000 && ok; ++n )
+    ok = mt::rand_u32_r(mine) == mt::rand_u32_r(&expected);
+
+  const int node = mt::state_node(mine);
+  ok = ok && (node < 0 || node == mt::current_node());
+
+  mt::MTState* theirs = NULL;
+  std::thread other([&]() {
+    theirs = mt::thread_state(77);
+    mt::rand_u32_r(theirs);
+  });
+  other.join();
+
+  ok = ok && theirs != NULL && theirs != mine;
+
+  printf("  * Thread states (node %d) %s\n", node, ok? "OK" : "ERROR");
+  return ok;
+}
+
+static int numa_nodes()
+{
+  int first = 0, last = 0;
+  FILE* f = fopen("/sys/devices/system/node/online", "r");
+
+  if ( f == NULL )
+    return 1;
+
+  // Like "0" or "0-1"; holes in the range are rare enough to ignore
+  const int n = fscanf(f, "%d-%d", &first, &last);
+  fclose(f);
+
+  return n == 2? last + 1 : first + 1;
+}
+
+/*
+ * From a thread pinned to CPU 0, draw from a pool of generators that is too
+ * large for the caches, placed on each NUMA node in turn.  Every refill then
+ * reads and writes the state from memory, which costs more on a remote node.
+ */
+static void run_numa_benchmark()
+{
+  static const size_t POOL = 4096;  // 20 MB of states
+  static const size_t DRAWS = 50000000;
+  static const size_t RUN = 16;
+
+  if ( !pin_to_cpu(0) )
+    printf("\nWarning: Could not pin to CPU 0, the thread may migrate\n");
+
+  const int nodes = numa_nodes();
+  const int home = mt::current_node();
+
+  printf("\n%zu generators (%zu MB), %zu draws from each in turn, from a "
+         "thread on node %d (best of 3)\n\n", POOL,
+         POOL*sizeof(mt::MTState) >> 20, RUN, home);
+
+  if ( nodes < 2 )
+    printf("  Only one NUMA node, so there's nothing remote to compare "
+           "with\n\n");
+
+  printf("  %6s %10s %10s\n", "node", "placed on", "ns/draw");
+
+  for ( int node = 0; node < nodes; ++node ) {
+    mt::MTState* pool = mt::state_node_alloc(POOL, node);
+
+    if ( pool == NULL ) {
+      printf("  %6d allocation failed\n", node);
+      continue;
+    }
+
+    for ( size_t n = 0; n < POOL; ++n )
+      mt::seed_r(&pool[n], n);
+
+    double best = DBL_MAX;
+
+    for ( int pass = 0; pass < 3; ++pass ) {
+      uint32_t sum = 0;
+
+      Timer timer;
+      for ( size_t n = 0; n < DRAWS / RUN; ++n ) {
+        mt::MTState* s = &pool[n % POOL];
+        for ( size_t k = 0; k < RUN; ++k )
+          sum += mt::rand_u32_fast_r(s);
+      }
+      best = std::min(best, timer.elapsed_secs());
+
+      do_not_optimize(sum);
+    }
+
+    printf("  %6d %10d %10.2f%s\n", node, mt::state_node(pool),
+        1e9 * best / DRAWS, node == home? "  (local)" : "  (remote)");
+
+    mt::state_node_free(pool, POOL);
+  }
+}
+
+/*
+ * Compact states must give the same numbers as full ones, however the draws
+ * from them are interleaved through a scratch area.
+ */
+static bool check_compact()
+{
+  const size_t count = 5;
+  mt::MTCompact compact[count];
+  mt::MTState full[count];
+  mt::MTScratch scratch;
+  memset(&scratch, 0, sizeof(scratch));
+
+  for ( size_t n = 0; n < count; ++n ) {
+    mt::compact_seed(&compact[n], 1000 + n);
+    mt::seed_r(&full[n], 1000 + n);
+  }
+
+  std::mt19937 engine(1);
+  bool ok = true;
+
+  for ( int run = 0; run < 2000 && ok; ++run ) {
+    const size_t n = engine() % count;
+    const size_t draws = engine() % (run % 10 == 0? 1500 : 20);
+
+    mt::compact_select(&scratch, &compact[n]);
+    for ( size_t k = 0; k < draws && ok; ++k )
+      ok = mt::compact_rand_u32(&scratch) == mt::rand_u32_r(&full[n]);
+  }
+
+  // Reseed running states, active or not, and go on drawing
+  for ( int run = 0; run < 200 && ok; ++run ) {
+    const size_t n = engine() % count;
+    const uint32_t value = engine();
+
+    mt::compact_select(&scratch, &compact[n]);
+    for ( size_t k = engine() % 700; k > 0 && ok; --k )
+      ok = mt::compact_rand_u32(&scratch) == mt::rand_u32_r(&full[n]);
+
+    if ( run % 3 == 1 )
+      mt::compact_select(&scratch, NULL);
+
+    mt::compact_seed(&compact[n], value);
+    mt::seed_r(&full[n], value);
+
+    // Without selecting it again, what was left of the old line comes first
+    if ( run % 3 == 2 ) {
+      for ( size_t k = scratch.end - scratch.pos; k > 0; --k )
+        mt::compact_rand_u32(&scratch);
+    } else
+      mt::compact_select(&scratch, &compact[n]);
+    for ( size_t k = engine() % 700; k > 0 && ok; --k )
+      ok = mt::compact_rand_u32(&scratch) == mt::rand_u32_r(&full[n]);
+
+    ok = ok && compact[n].index <= 624;
+  }
+
+  mt::compact_select(&scratch, NULL);
+
+  printf("  * Compact states %s\n", ok? "OK" : "ERROR");
+  return ok;
+}
+
+static bool check_incremental()
+{
+  mt::MTIncremental incremental;
+  mt::MTState full;
+  bool ok = true;
+
+  for ( uint32_t value = 0; value < 20 && ok; ++value ) {
+    mt::incremental_seed(&incremental, value);
+    mt::seed_r(&full, value);
+
+    // Several blocks, so that every increment is twisted more than once
+    for ( size_t n = 0; n < 5*624 + value && ok; ++n )
+      ok = mt::incremental_rand_u32(&incremental) == mt::rand_u32_r(&full);
+  }
+
+  printf("  * Incremental states %s\n", ok? "OK" : "ERROR");
+  return ok;
+}
+
+static bool check_lookahead()
+{
+  const size_t sizes[] = {1, 2, 4, 16};
+  std::mt19937 engine(2);
+  std::vector<uint32_t> ours, theirs;
+  bool ok = true;
+
+  for ( size_t blocks : sizes ) {
+    mt::MTLookahead lookahead;
+    mt::MTState full;
+
+    if ( mt::lookahead_init(&lookahead, blocks, 0) != 0 ) {
+      printf("  * Lookahead states: out of memory\n");
+      return false;
+    }
+
+    for ( uint32_t value = 0; value < 5 && ok; ++value ) {
+      mt::lookahead_seed(&lookahead, value);
+      mt::seed_r(&full, value);
+
+      // Single draws and fills that cross the ends of blocks and refills
+      for ( int run = 0; run < 50 && ok; ++run ) {
+        const size_t count = engine() % 3000;
+
+        if ( run % 2 == 0 ) {
+          for ( size_t n = 0; n < count && ok; ++n )
+            ok = mt::lookahead_rand_u32(&lookahead) == mt::rand_u32_r(&full);
+        } else {
+          ours.resize(count + 1);
+          theirs.resize(count + 1);
+          mt::lookahead_u32_array(&lookahead, &ours[0], count);
+          mt::rand_u32_array_r(&full, &theirs[0], count);
+          ok = std::equal(ours.begin(), ours.begin() + count, theirs.begin());
+        }
+      }
+    }
+
+    mt::lookahead_free(&lookahead);
+  }
+
+  printf("  * Lookahead states %s\n", ok? "OK" : "ERROR");
+  return ok;
+}
+
+/*
+ * Draw numbers one at a time and in bulk, from an MTState and from lookahead
+ * states of increasing size.  Larger refills make for fewer of them, but the
+ * buffer grows by 5 KB per block and eventually falls out of the L1 cache.
+ */
+static void run_lookahead_benchmark()
+{
+  static const size_t DRAWS = 100000000;
+  static const size_t CHUNK = 4096;
+
+  printf("\nOne number at a time and in bulk fills of %zu (ns per number, "
+         "best of 3)\n\n", CHUNK);
+  printf("  %-16s %10s %10s %10s\n", "", "buffer", "inline", "bulk");
+
+  std::vector<uint32_t> buffer(CHUNK);
+  const size_t sizes[] = {0, 1, 2, 4, 16, 64};
+
+  for ( size_t blocks : sizes ) {
+    mt::MTState* full = new mt::MTState;
+    mt::MTLookahead lookahead;
+
+    if ( blocks > 0 && mt::lookahead_init(&lookahead, blocks, 0) != 0 ) {
+      printf("  Out of memory\n");
+      delete full;
+      return;
+    }
+
+    double secs[2] = {DBL_MAX, DBL_MAX};
+
+    for ( int pass = 0; pass < 3; ++pass ) {
+      uint32_t sum = 0;
+      mt::seed_r(full, pass);
+      if ( blocks > 0 )
+        mt::lookahead_seed(&lookahead, pass);
+
+      Timer timer;
+      if ( blocks == 0 ) {
+        for ( size_t n = 0; n < DRAWS; ++n )
+          sum += mt::rand_u32_fast_r(full);
+      } else {
+        for ( size_t n = 0; n < DRAWS; ++n )
+          sum += mt::lookahead_rand_u32(&lookahead);
+      }
+      secs[0] = std::min(secs[0], timer.elapsed_secs());
+      do_not_optimize(sum);
+
+      timer.reset();
+      for ( size_t n = 0; n < DRAWS; n += CHUNK ) {
+        if ( blocks == 0 )
+          mt::rand_u32_array_r(full, &buffer[0], CHUNK);
+        else
+          mt::lookahead_u32_array(&lookahead, &buffer[0], CHUNK);
+        do_not_optimize(buffer[0]);
+      }
+      secs[1] = std::min(secs[1], timer.elapsed_secs());
+    }
+
+    char name[32];
+    if ( blocks == 0 )
+      snprintf(name, sizeof(name), "MTState");
+    else
+      snprintf(name, sizeof(name), "%zu block%s", blocks,
+          blocks > 1? "s" : "");
+
+    const size_t bytes = blocks == 0? sizeof(mt::MTState) :
+      (2*blocks + 1)*624*sizeof(uint32_t);
+
+    printf("  %-16s %8zu K %10.3f %10.3f\n", name, (bytes + 1023) / 1024,
+        1e9 * secs[0] / DRAWS, 1e9 * secs[1] / DRAWS);
+
+    if ( blocks > 0 )
+      mt::lookahead_free(&lookahead);
+    delete full;
+  }
+}
+
+/*
+ * Switch between many generators, drawing a few numbers from each, with full
+ * states and with compact ones that share one scratch area.
+ */
+static void run_compact_benchmark(const size_t entities)
+{
+  static const size_t DRAWS = 20000000;
+
+  printf("\n%zu generators, switching to a random one every k draws "
+         "(ns per draw, best of 3)\n\n", entities);
+
+  mt::MTState* full = mt::state_arena_alloc(entities, NULL);
+  mt::MTCompact* compact = mt::compact_arena_alloc(entities, NULL);
+
+  if ( full == NULL || compact == NULL ) {
+    printf("  Out of memory\n");
+    mt::state_arena_free(full, entities);
+    mt::compact_arena_free(compact, entities);
+    return;
+  }
+
+  for ( size_t n = 0; n < entities; ++n ) {
+    mt::seed_r(&full[n], n);
+    mt::compact_seed(&compact[n], n);
+  }
+
+  printf("  %8s %18s %18s\n", "k", "MTState", "MTCompact");
+  printf("  %8s %12zu bytes %12zu bytes\n", "memory", sizeof(mt::MTState),
+      sizeof(mt::MTCompact));
+
+  mt::MTScratch scratch;
+  memset(&scratch, 0, sizeof(scratch));
+
+  const size_t runs[] = {1, 4, 16, 64, 624};
+
+  for ( size_t k : runs ) {
+    double secs[2] = {DBL_MAX, DBL_MAX};
+
+    for ( int pass = 0; pass < 3; ++pass ) {
+      uint64_t x = 88172645463325252ull + pass;
+      uint32_t sum = 0;
+
+      Timer timer;
+      for ( size_t n = 0; n < DRAWS; n += k ) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        mt::MTState* s = &full[(x >> 32) * entities >> 32];
+
+        for ( size_t d = 0; d < k; ++d )
+          sum += mt::rand_u32_fast_r(s);
+      }
+      secs[0] = std::min(secs[0], timer.elapsed_secs());
+
+      timer.reset();
+      for ( size_t n = 0; n < DRAWS; n += k ) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        mt::compact_select(&scratch, &compact[(x >> 32) * entities >> 32]);
+
+        for ( size_t d = 0; d < k; ++d )
+          sum += mt::compact_rand_u32(&scratch);
+      }
+      secs[1] = std::min(secs[1], timer.elapsed_secs());
+
+      do_not_optimize(sum);
+    }
+
+    printf("  %8zu %18.2f %18.2f\n", k, 1e9 * secs[0] / DRAWS,
+        1e9 * secs[1] / DRAWS);
+  }
+
+  mt::compact_select(&scratch, NULL);
+  mt::state_arena_free(full, entities);
+  mt::compact_arena_free(compact, entities);
+}
+
+/*
+ * Draw from many generators in random order, one number at a time, like a
+ * simulation with one generator per agent.  With enough agents nearly every
+ * draw touches a new page, so this mostly measures TLB misses, which the
+ * huge-page arena avoids.
+ */
+template<class STATES>
+static double time_agents(STATES states, const size_t agents,
+    const size_t draws)
+{
+  std::vector<uint32_t> seeds(agents);
+  for ( size_t n = 0; n < agents; ++n )
+    seeds[n] = n;
+
+  mt::seed_batch_r(&states[0], &seeds[0], agents);
+
+  // Fill every block, so that refills aren't what's being timed
+  for ( size_t n = 0; n < agents; ++n )
+    mt::rand_u32_fast_r(&states[n]);
+
+  double best = DBL_MAX;
+
+  for ( int pass = 0; pass < 3; ++pass ) {
+    uint64_t x = 88172645463325252ull + pass;
+    uint32_t sum = 0;
+
+    Timer timer;
+    for ( size_t n = 0; n < draws; ++n ) {
+      // xorshift64 to pick the agent without touching more memory
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      sum += mt::rand_u32_fast_r(&states[(x >> 32) * agents >> 32]);
+    }
+    do_not_optimize(sum);
+    best = std::min(best, timer.elapsed_secs());
+  }
+
+  return best;
+}
+
+static void run_agents_benchmark(const size_t agents)
+{
+  const size_t draws = 20000000;
+
+  printf("\n%zu generators of %zu bytes, %zu draws in random order "
+         "(best of 3)\n\n", agents, sizeof(mt::MTState), draws);
+
+  {
+    std::vector<mt::MTState> states(agents);
+    const double secs = time_agents(&states[0], agents, draws);
+    printf("  %-44s %7.2f ns/draw\n", "std::vector", 1e9 * secs / draws);
+  }
+
+  int huge = 0;
+  mt::MTState* arena = mt::state_arena_alloc(agents, &huge);
+
+  if ( arena == NULL ) {
+    printf("  state_arena_alloc failed\n");
+    return;
+  }
+
+  const double secs = time_agents(arena, agents, draws);
+  const char* how[] = {"4 KiB pages", "transparent huge pages",
+    "MAP_HUGETLB"};
+
+  printf("  %-44s %7.2f ns/draw\n",
+      (std::string("state_arena_alloc, ") + how[huge]).c_str(),
+      1e9 * secs / draws);
+
+  mt::state_arena_free(arena, agents);
+}
+
+// Compare the next `count` numbers of ours and theirs
+static bool same_numbers(mt::MTState* ours, reference::genrand_state* theirs,
+    size_t count)
+{
+  for ( size_t n = 0; n < count; ++n ) {
+    if ( mt::rand_u32_r(ours) != reference::genrand_int32_r(theirs) )
+      return false;
+  }
+
+  return true;
+}
+
+/*
+ * Check numbers far into the stream.  The reference is moved there with a
+ * GF(2) jump-ahead, which is itself checked against stepping and against
+ * discard().  Positions 2^40 and 2^64 can't be reached by stepping, so there
+ * the jumped reference state is loaded into our generator with set_state()
+ * and both are compared for a few blocks, with every kernel.  With `deep`,
+ * our own generator also steps all the way to 2^32 with discard().
+ */
+static bool check_far_positions(const bool deep)
+{
+  static const size_t BLOCKS = 3*624 + 1;
+  const uint64_t skips[] = {0, 1, 623, 624, 625, 5000, 1000003};
+
+  mt::MTState ours;
+  reference::genrand_state theirs;
+
+  for ( uint64_t skip : skips ) {
+    mt::seed_r(&ours, 42);
+    mt::discard_r(&ours, skip);
+
+    reference::init_genrand_r(&theirs, 42);
+    for ( uint64_t n = 0; n < skip; ++n )
+      reference::genrand_int32_r(&theirs);
+
+    if ( !same_numbers(&ours, &theirs, BLOCKS) ) {
+      printf("  * Far positions ERROR (discard %" PRIu64 ")\n", skip);
+      return false;
+    }
+
+    mt::seed_r(&ours, 42);
+    mt::discard_r(&ours, skip);
+
+    reference::init_genrand_r(&theirs, 42);
+    reference::genrand_jump_r(&theirs, skip);
+
+    if ( !same_numbers(&ours, &theirs, BLOCKS) ) {
+      printf("  * Far positions ERROR (jump %" PRIu64 ")\n", skip);
+      return false;
+    }
+  }
+
+  printf("  * Far positions");
+
+  if ( deep ) {
+    const uint64_t position = uint64_t(1) << 32;
+
+    mt::seed_r(&ours, 5489);
+    mt::discard_r(&ours, position);
+
+    reference::init_genrand_r(&theirs, 5489);
+    reference::genrand_jump_r(&theirs, position);
+
+    if ( !same_numbers(&ours, &theirs, BLOCKS) ) {
+      printf(" ERROR (discard 2^32)\n");
+      return false;
+    }
+
+    printf(" discard 2^32");
+  }
+
+  const char* initial = mt::kernel_current();
+  const int exponents[] = {32, 40, 64};
+
+  for ( int e : exponents ) {
+    /*
+     * Jump to 624 numbers short of 2^e, which also keeps 2^64 in range, and
+     * skip the rest on both sides.
+     */
+    const uint64_t start = (e < 64? uint64_t(1) << e : 0) - 624;
+
+    reference::genrand_state jumped;
+    reference::init_genrand_r(&jumped, 5489);
+    reference::genrand_jump_r(&jumped, start);
+
+    mt::MTState loaded;
+    for ( size_t i = 0; i < 624; ++i )
+      loaded.MT[i] = uint32_t(jumped.mt[i]);
+    loaded.index = 624;
+
+    for ( size_t n = 0; n < 624; ++n )
+      reference::genrand_int32_r(&jumped);
+
+    for ( size_t k = 0; k < mt::kernel_count(); ++k ) {
+      mt::kernel_select(mt::kernel_name(k));
+      mt::set_state(&loaded);
+      mt::discard(624);
+
+      theirs = jumped;
+
+      bool ok = true;
+      for ( size_t n = 0; n < BLOCKS && ok; ++n )
+        ok = mt::rand_u32() == reference::genrand_int32_r(&theirs);
+
+      if ( !ok ) {
+        printf(" ERROR (2^%d, kernel %s)\n", e, mt::kernel_name(k));
+        mt::kernel_select(initial);
+        return false;
+      }
+    }
+
+    printf(" 2^%d", e);
+  }
+
+  mt::kernel_select(initial);
+  printf(" OK\n");
+  return true;
+}
+
+/*
+ * Compare rand_shuffle_u32 with std::shuffle driven by std::mt19937 for
+ * array sizes 10^6, 10^7, ... up to max_count.
+ */
+static void run_shuffle_benchmark(const size_t max_count)
+{
+  printf("\nShuffling arrays (ns per element, best of 3)\n\n");
+  printf("  %12s %12s %12s %8s\n", "elements", "rand_shuffle", "std::shuffle",
+      "speedup");
+
+  for ( size_t count = 1000000; count <= max_count; count *= 10 ) {
+    std::vector<uint32_t> a(count);
+    for ( size_t n = 0; n < count; ++n )
+      a[n] = n;
+
+    double ours = DBL_MAX, theirs = DBL_MAX;
+
+    for ( int pass = 0; pass < 3; ++pass ) {
+      Timer timer;
+      mt::seed(pass);
+      mt::rand_shuffle_u32(&a[0], count);
+      ours = std::min(ours, timer.elapsed_secs());
+
+      timer.reset();
+      std::mt19937 engine(pass);
+      std::shuffle(a.begin(), a.end(), engine);
+      theirs = std::min(theirs, timer.elapsed_secs());
+    }
+
+    printf("  %12zu %12.2f %12.2f %7.2fx\n", count, 1e9*ours/count,
+        1e9*theirs/count, theirs/ours);
+  }
+}
+
+static void usage(const char* prog)
+{
+  fprintf(stderr,
+      "Usage: %s [options] [passes]\n"
+      "\n"
+      "  --timer=rusage|raw|tsc   timing backend\n"
+      "  --json=FILE --csv=FILE   write the benchmark results\n"
+      "  --baseline=FILE          compare against earlier JSON results\n"
+      "  --threshold=PERCENT      regression threshold (default 5)\n"
+      "  --threads[=N] --pin      scaling over threads, optionally pinned\n"
+      "  --latency[=BATCH]        per-call latency histogram\n"
+      "  --perf                   read hardware counters\n"
+      "  --seeds=N --numbers=N    size of the parallel verification\n"
+      "  --deep                   step our generator out to 2^32\n"
+      "  --optimized              also time optimized caller loops\n"
+      "  --lookahead --numa       lookahead and NUMA benchmarks\n"
+      "  --compact[=N]            compact state benchmark\n"
+      "  --agents[=N]             many small generators benchmark\n"
+      "  --seeding                seeding benchmark\n"
+      "  --sweep[=BYTES]          array size sweep\n"
+      "  --tune[=FILE]            time the twist kernels, write the fastest\n"
+      "  --shuffle[=N]            shuffle benchmark\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+  printf("Testing Mersenne Twister with reference implementation\n");
+
+  int benchmark_passes = 15;
+  size_t shuffle_max = 0;
+  const char* json_file = NULL;
+  const char* csv_file = NULL;
+  const char* baseline_file = NULL;
+  double threshold = 5;
+  unsigned max_threads = 0;
+  size_t latency_batch = 0;
+  bool pin_threads = false;
+  const char* tune_file = NULL;
+  size_t sweep_max = 0;
+  bool seeding = false;
+  size_t agents = 0;
+  size_t compact = 0;
+  bool numa = false;
+  bool lookahead = false;
+  bool optimized_loops = false;
+  uint32_t verify_seeds = 5000;
+  uint32_t verify_numbers = 5000;
+  bool deep = false;
+
+  calibrate_tsc();
+  timer_backend = tsc_hz > 0? TIMER_TSC : TIMER_RUSAGE;
+
+  for ( int n = 1; n < argc; ++n ) {
+    if ( !strcmp(argv[n], "--timer=rusage") )
+      timer_backend = TIMER_RUSAGE;
+    else if ( !strcmp(argv[n], "--timer=raw") )
+      timer_backend = TIMER_MONOTONIC_RAW;
+    else if ( !strcmp(argv[n], "--timer=tsc") && tsc_hz > 0 )
+      timer_backend = TIMER_TSC;
+    else if ( !strcmp(argv[n], "--timer=tsc") )
+      printf("No invariant TSC, using %s instead\n", timer_name());
+    else if ( !strncmp(argv[n], "--json=", 7) )
+      json_file = argv[n] + 7;
+    else if ( !strncmp(argv[n], "--csv=", 6) )
+      csv_file = argv[n] + 6;
+    else if ( !strncmp(argv[n], "--baseline=", 11) )
+      baseline_file = argv[n] + 11;
+    else if ( !strncmp(argv[n], "--threshold=", 12) )
+      threshold = atof(argv[n] + 12);
+    else if ( !strcmp(argv[n], "--threads") )
+      max_threads = std::thread::hardware_concurrency();
+    else if ( !strncmp(argv[n], "--threads=", 10) )
+      max_threads = atoi(argv[n] + 10);
+    else if ( !strcmp(argv[n], "--pin") )
+      pin_threads = true;
+    else if ( !strcmp(argv[n], "--latency") )
+      latency_batch = 1;
+    else if ( !strncmp(argv[n], "--latency=", 10) )
+      latency_batch = strtoull(argv[n] + 10, NULL, 10);
+    else if ( !strcmp(argv[n], "--perf") )
+      use_perf = true;
+    else if ( !strncmp(argv[n], "--seeds=", 8) )
+      verify_seeds = strtoul(argv[n] + 8, NULL, 10);
+    else if ( !strncmp(argv[n], "--numbers=", 10) )
+      verify_numbers = strtoul(argv[n] + 10, NULL, 10);
+    else if ( !strcmp(argv[n], "--deep") )
+      deep = true;
+    else if ( !strcmp(argv[n], "--optimized") )
+      optimized_loops = true;
+    else if ( !strcmp(argv[n], "--lookahead") )
+      lookahead = true;
+    else if ( !strcmp(argv[n], "--numa") )
+      numa = true;
+    else if ( !strcmp(argv[n], "--compact") )
+      compact = 100000;
+    else if ( !strncmp(argv[n], "--compact=", 10) )
+      compact = strtoull(argv[n] + 10, NULL, 10);
+    else if ( !strcmp(argv[n], "--agents") )
+      agents = 100000;
+    else if ( !strncmp(argv[n], "--agents=", 9) )
+      agents = strtoull(argv[n] + 9, NULL, 10);
+    else if ( !strcmp(argv[n], "--seeding") )
+      seeding = true;
+    else if ( !strcmp(argv[n], "--sweep") )
+      sweep_max = size_t(1) << 30;
+    else if ( !strncmp(argv[n], "--sweep=", 8) )
+      sweep_max = strtoull(argv[n] + 8, NULL, 10);
+    else if ( !strcmp(argv[n], "--tune") )
+      tune_file = "mt-kernel.mk";
+    else if ( !strncmp(argv[n], "--tune=", 7) )
+      tune_file = argv[n] + 7;
+    else if ( !strcmp(argv[n], "--shuffle") )
+      shuffle_max = 100000000;
+    else if ( !strncmp(argv[n], "--shuffle=", 10) )
+      shuffle_max = strtoull(argv[n] + 10, NULL, 10);
+    else if ( argv[n][0] == '-' ) {
+      fprintf(stderr, "Unknown option %s\n\n", argv[n]);
+      usage(argv[0]);
+      return 1;
+    } else
+      benchmark_passes = atoi(argv[n]);
+  }
+
+  if ( !verify_parallel(verify_seeds, verify_numbers) )
+    return 1;
+
+  if ( !check_normals() || !check_shuffle() || !check_sampling() ||
+       !check_masks() || !check_bytes() || !check_std_engines() ||
+       !check_arrays() || !check_seeding() || !check_unaligned_state() ||
+       !check_arena() || !check_compact() || !check_incremental() ||
+       !check_lookahead() || !check_thread_state() ||
+       !check_far_positions(deep) )
+    return 1;
+
+  if ( use_perf && !perf.open() ) {
+    printf("\nHardware counters are unavailable (check "
+           "/proc/sys/kernel/perf_event_paranoid), running without them\n");
+    use_perf = false;
+  }
+
+  printf("\nUsing %s for timing", timer_name());
+  if ( tsc_hz > 0 )
+    printf(", TSC runs at %.3f GHz", tsc_hz / 1e9);
+  printf("\n");
+
+  if ( tune_file != NULL )
+    return run_tune(tune_file)? 0 : 1;
+
+  if ( lookahead ) {
+    run_lookahead_benchmark();
+    return 0;
+  }
+
+  if ( numa ) {
+    run_numa_benchmark();
+    return 0;
+  }
+
+  if ( compact > 0 ) {
+    run_compact_benchmark(compact);
+    return 0;
+  }
+
+  if ( agents > 0 ) {
+    run_agents_benchmark(agents);
+    return 0;
+  }
+
+  if ( seeding ) {
+    run_seeding_benchmark();
+    return 0;
+  }
+
+  if ( sweep_max > 0 ) {
+    run_sweep_benchmark(sweep_max);
+    return 0;
+  }
+
+  if ( shuffle_max > 0 ) {
+    run_shuffle_benchmark(shuffle_max);
+    return 0;
+  }
+
+  if ( latency_batch > 0 ) {
+    run_latency_benchmark(latency_batch);
+    return 0;
+  }
+
+  if ( max_threads > 0 ) {
+    run_thread_benchmark(max_threads, pin_threads);
+    return 0;
+  }
+
+  run_benchmark(benchmark_passes, optimized_loops);
+
+  if ( json_file != NULL && !write_json(json_file) )
+    return 1;
+
+  if ( csv_file != NULL && !write_csv(csv_file) )
+    return 1;
+
+  if ( baseline_file != NULL && !compare_baseline(baseline_file, threshold) )
+    return 1;
 
-  run_benchmark(benchmark_passes);
   return 0;
 }